@@ -1,14 +1,29 @@
 #pragma once
 
-#include <PCA9685.h>
 #include "lasersensor.h"
+#include "sensorsampler.h"
+#include "polarscanner.h"
+#include "rangingscheduler.h"
+#include "headingestimator.h"
 #include "servo.h"
-#include "ttMotor.h"
+#include "pca9685shadow.h"
+#include "pwm.h"
+
+// what the four motors do together
+enum class Motion
+{
+  STOP = 0,
+  FORWARD = 1,
+  BACKWARD = 2,
+  SPIN_LEFT = 3,
+  SPIN_RIGHT = 4,
+  COUNT = 5
+};
 
 class Car
 {
 public:
-  Car(PiPCA9685::PCA9685 *pPCA9685, LaserSensor *pLftSensor, LaserSensor *pRghtSensor,
+  Car(Pca9685Shadow *pPCA9685, LaserSensor *pLftSensor, LaserSensor *pRghtSensor,
       LaserSensor *pFwrdSensor, LaserSensor *pFlrSensor, Servo *pTurningServo);
   bool IsMoving();
   void SetSpeed(int percent);
@@ -21,21 +36,37 @@ public:
   void MovingStepForward();
   void FollowVoiceCommands();
   void ParseVoiceCommand(const char *voiceString);
+  void SetSampler(SensorSampler *pSensorSampler);
+  void SetScanner(PolarScanner *pPolarScanner);
+  void SetScheduler(RangingScheduler *pScheduler);
+  void SetMotorDuty(float leftDuty, float rightDuty); // -1 - 1, negative is backward
+  void SetHardwarePwm(PWM *pPwm, int leftChannel, int rightChannel);
+  void SetHeadingEstimator(HeadingEstimator *pEstimator);
 
 private:
+  void Drive(Motion motion, int leftTicks, int rightTicks);
+  bool IsFloorAhead(int floorDistance);
+  bool IsFresh(const RangeSample &sample);
+  int GetFloorDistanceCm();
   bool is_moving;
   bool last_turn_to_left;
-  int speed;
+  float duty;      // of the motors while moving forward or backward
+  float turn_duty; // while turning
   int max_floor_distance;
   int min_forward_distance;
+  int max_sample_age_ms;
+  int min_gap_degrees;
+  SensorSampler *pSampler;
+  PolarScanner *pScanner;
+  RangingScheduler *pRangingScheduler;
+  HeadingEstimator *pHeading;
   LaserSensor *pLeftSensor;
   LaserSensor *pRightSensor;
   LaserSensor *pForwardSensor;
   LaserSensor *pFloorSensor;
   Servo *pServo;
-  PiPCA9685::PCA9685 *pPCA;
-  TTMotor *pLeftFrontMotor;
-  TTMotor *pRightFrontMotor;
-  TTMotor *pLeftBackMotor;
-  TTMotor *pRightBackMotor;
+  Pca9685Shadow *pPCA;
+  PWM *pMotorPwm; // NULL if the speed pins are on the PCA9685 too
+  int leftPwmChannel;
+  int rightPwmChannel;
 };
\ No newline at end of file
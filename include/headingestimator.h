@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "lsm6dsox_lis3mdl.h"
+
+// Its thread drains the IMU's FIFO and integrates every gyro sample over the chip's
+// own timestamps, so the heading is up to date whenever it is read, without any waiting.
+// Left turns are positive, like the gyro's z axis.
+class HeadingEstimator
+{
+public:
+    HeadingEstimator(Lsm6dsoxLis3mdl *pImu);
+    ~HeadingEstimator();
+    bool Start(int periodMs = 10);
+    void Stop();
+    bool CalibrateBias(int durationMs = 200); // the car must stand still meanwhile
+    void ResetHeading(); // the current direction is 0 from now on
+    double GetHeading(); // degrees since ResetHeading()
+    double GetRateDps(); // of the last sample
+
+private:
+    void Run();
+
+    Lsm6dsoxLis3mdl *pLsmLis;
+    int readPeriodMs;
+    std::atomic<bool> is_running;
+    std::thread worker;
+    std::atomic<double> integratedHeading; // only the thread writes these two
+    std::atomic<double> rateDps;
+    std::atomic<double> headingZero;
+    std::atomic<double> biasDps;
+    std::mutex calibrationMutex; // the sums of the calibration
+    bool is_calibrating;
+    double calibrationSum;
+    int calibrationCount;
+    static_assert(std::atomic<double>::is_always_lock_free, "the heading must be readable without a lock");
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+// priorities of the i2c bus users, the lower value goes first
+enum class I2cPriority
+{
+    CLIFF = 0,   // floor sensor: is there floor ahead of the car
+    RANGING = 1, // forward, left and right laser sensors
+    IMU = 2,     // accelerometer, gyro and compass
+    PWM = 3,     // PCA9685: servo and TT motors
+    COUNT = 4
+};
+
+// The i2c bus arbiter: while it is running, its thread is the only one that
+// talks to the bus. The other threads (main loop, voice processing, testing)
+// queue transactions, and the highest priority one waiting is done next,
+// so e.g. a slow compass read does not delay a cliff check.
+// A transaction should be short (a few register accesses), long waits
+// (like waiting for a ranging to finish) belong to the caller, between transactions.
+class I2cArbiter
+{
+public:
+    I2cArbiter();
+    ~I2cArbiter();
+    bool Start();
+    void Stop();
+    std::future<int> Submit(I2cPriority priority, std::function<int()> transaction);
+    int Execute(I2cPriority priority, std::function<int()> transaction);
+
+private:
+    struct Transaction
+    {
+        std::function<int()> work;
+        std::promise<int> done;
+    };
+
+    void Run();
+    static void Perform(Transaction &transaction);
+
+    bool is_running;
+    std::thread worker;
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::deque<Transaction> queues[(int)I2cPriority::COUNT];
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <mutex>
+#include <functional>
+#include <future>
+#include "i2carbiter.h"
+
+extern "C"
+{
+#include <tof.h> // time of flight sensor library (it has the i2c register access functions)
+}
+
+// One device on the i2c bus. It has its own file handle bound to its address,
+// so there is no need for switchSensor() (and a settle sleep) before talking to it.
+// Every access is a transaction: a function getting the device's handle that
+// is done as one unit, through the bus arbiter (with the device's priority)
+// if the device has one. Don't wait for a transaction inside another one.
+class I2cDevice
+{
+public:
+    I2cDevice(int slaveAddress, int channel = 1);
+    ~I2cDevice();
+    bool Open();
+    bool SetAddress(int newSlaveAddress);
+    int GetAddress();
+    void SetArbiter(I2cArbiter *pI2cArbiter, I2cPriority i2cPriority);
+    int Transact(std::function<int(I2CDEV *)> transaction);
+    std::future<int> SubmitTransaction(std::function<int(I2CDEV *)> transaction);
+    unsigned char ReadReg(unsigned char reg);
+    unsigned short ReadReg16(unsigned char reg);
+    bool ReadMulti(unsigned char reg, unsigned char *pBuffer, int count); // returns true on error
+    void WriteReg(unsigned char reg, unsigned char value);
+    void WriteReg16(unsigned char reg, unsigned short value);
+    void WriteMulti(unsigned char reg, unsigned char *pBuffer, int count);
+    void WriteRegList(unsigned char *pList);
+
+private:
+    int i2cChannel;
+    int i2cSlaveAddress;
+    I2CDEV dev;
+    std::recursive_mutex mutex;
+    I2cArbiter *pArbiter;
+    I2cPriority priority;
+};
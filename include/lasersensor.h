@@ -1,14 +1,46 @@
 #pragma once
 
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include "i2cdevice.h"
+
+// one result of a sensor, as it was read in one burst
+struct RangeSample
+{
+    int distanceMm;        // negative (TOF_TIMEOUT) if there is no result
+    int rangeStatus;       // TOF_RANGE_COMPLETE if the distance is valid
+    float signalRateMcps;  // the returned signal, low on dark or far targets
+    float ambientRateMcps; // the ambient light
+    std::chrono::steady_clock::time_point time; // when the sensor had the result
+    bool IsValid() const { return distanceMm >= 0 && rangeStatus == TOF_RANGE_COMPLETE; }
+    int DistanceCm() const { return distanceMm < 0 ? distanceMm : distanceMm / 10; }
+    int AgeMs() const { return (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time).count(); }
+};
+
 class LaserSensor
 {
 public:
     LaserSensor();
     bool ResetSensor(int gpioPin);
+    bool IsConfigured(int slaveAddress); // true if a sensor answers at the address already
+    bool Reuse(int gpioPin, int slaveAddress); // takes over a configured sensor without reset
     bool FinishResetting();
     bool SetAddress(int slaveAddress);
     bool Init();
-    int GetDistanceCm();
+    int GetDistanceCm(); // negative (TOF_TIMEOUT) if there is no valid reading (no result, or its status is not TOF_RANGE_COMPLETE)
+    RangeSample GetSample(); // the same with all the details of the result
+    static bool GetDistancesCm(LaserSensor *pSensors[], int count, int distances[]); // true if any of them has no valid reading
+    static bool GetSamples(LaserSensor *pSensors[], int count, RangeSample samples[]);
+    bool StartContinuous(int periodMs = 0);
+    bool StopContinuous();
+    bool SetProfile(TOFPROFILE profile); // can be switched while ranging continuously
+    uint32_t GetTimingBudgetUs(); // how long a ranging integrates
+    int GetLatestDistanceCm(int *pAgeMs);
+    RangeSample GetLatestSample();
+    bool SetInterruptPin(int gpioPin); // GPIO1 of the sensor, signals a new sample (active low)
+    void SetPolling(const TOFPOLLCFG &config);
+    void SetArbiter(I2cArbiter *pArbiter, I2cPriority priority);
     void Finish();
     bool TestAddressChange(int slaveAddress);
 
@@ -16,4 +48,26 @@ private:
     int i2cSlaveAddress;
     int gpioRestPin;
     struct gpiod_line *pGpioLine;
+    int gpioIntPin;
+    struct gpiod_line *pIntLine;
+    I2cDevice *pDevice;
+    TOFCTX tof; // this sensor's driver state
+    std::mutex rangingMutex;
+    TOFPOLLCFG pollConfig;
+    bool is_continuous;
+    int continuousPeriodMs;
+    RangeSample lastSample;
+    std::chrono::steady_clock::time_point lastEventTime; // of the last GPIO1 edge
+    std::chrono::steady_clock::time_point sampleDueTime; // without its edge by then, the status register is polled
+    int calibrationAddress; // the cached calibration is kept for this address
+    bool LoadCalibration();
+    bool SaveCalibration();
+    bool FetchLatestSample();
+    void ReadSample(std::chrono::steady_clock::time_point time);
+    int StartRanging(TOFPOLL *pPoll);
+    int CollectRanging();
+    bool WaitSampleEvent(uint32_t timeoutUs);
+    bool IsInterruptWorking();
+    void ExpectSample();
+    bool TransactSteps(const std::function<int(I2CDEV *, int)> &step); // true on error
 };
\ No newline at end of file
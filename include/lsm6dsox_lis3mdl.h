@@ -1,3 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "i2carbiter.h"
+
+#define LSM6DSOX_TIMESTAMP_LSB_US 25.0 // the FIFO timestamps count in these
+
+class I2cDevice;
+
 class Lsm6dsoxLis3mdl
 {
 public:
@@ -6,7 +16,18 @@ public:
       T x, y, z;
     };
 
+    // one batch of the FIFO: the gyro and accel values at the same timestamp
+    struct FifoSample
+    {
+      uint32_t timestamp; // LSB: LSM6DSOX_TIMESTAMP_LSB_US
+      vector<int> gyro;
+      vector<int> accel;
+      unsigned char fresh; // which ones are in this batch: 1: accel, 2: gyro
+    };
+
+    Lsm6dsoxLis3mdl();
     bool Init();
+    void SetArbiter(I2cArbiter *pArbiter);
     vector<int> GetAcceleratorRawValues();
     void CalculateAcceleratorAveBias();
     vector<double> GetAccelatorValues();
@@ -14,17 +35,28 @@ public:
     vector<int> GetGyroRawValues();
     void CalculateGyroAveBias();
     vector<double> GetGyroValues();
+    vector<double> GyroRawToDps(vector<int> rawValues); // corrected with the average bias
     vector<double> GetGyroAngles(int storeValueStepMs, vector<double> lastGyroAngles);
     vector<int> GetCompassRawValues();
     void CalculateCompassMinMax();
     vector<double> HardAndSoftIronCorrectedHeading(vector<int> rawValues);
     vector<double> GetCompassValues();
     vector<double> GetCompassValuesHSCorrected();
+    unsigned char ReadRawValues(vector<int> &accel, vector<int> &gyro, vector<int> &compass);
+    bool StartFifo(int batchRateHz = 417); // gyro and accel batched at this rate, with timestamps
+    void StopFifo();
+    int ReadFifo(std::vector<FifoSample> &samples); // appends what is in the FIFO, returns the words read
 
     vector<double> lastGyroAngles;
    private:
+    I2cDevice *pLsm6dsox;
+    I2cDevice *pLis3mdl;
+    unsigned char ReadStatusAndValues(I2cDevice *pDevice, unsigned char statusReg, unsigned char readyMask,
+                                      unsigned char valuesReg, unsigned char buffer[6]);
     vector<int> accelRawBias;
     vector<int> gyroRawBias;
     vector<int> lastGyroRawValues;
     vector<int> lastAccelRawValues;
+    FifoSample fifoSample; // the batch being decoded, its words may come in two reads
+    bool fifoOverrunReported;  // it has been reported already
 };
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <mutex>
+#include "i2cdevice.h"
+
+#define PCA9685_CHANNELS 16
+#define PCA9685_FREQUENCY_HZ 50 // the SG90 servo requires this
+
+// The PCA9685's 16 channel registers (ON and OFF, 4 bytes each) are kept in a shadow copy.
+// The Set functions only change the copy, Flush() writes the changed channels in one
+// auto-increment burst: the changes of all the motors are one transaction, and
+// a value that is already there costs nothing.
+class Pca9685Shadow
+{
+public:
+    Pca9685Shadow(int slaveAddress = 0x40, float frequencyHz = PCA9685_FREQUENCY_HZ);
+    ~Pca9685Shadow();
+    bool Open(); // after the frequency is set, reads the registers the board has now
+    void SetArbiter(I2cArbiter *pArbiter, I2cPriority priority);
+    void SetPwm(int channel, int on, int off); // in ticks of the 4096 ticks long period
+    void SetPwmMs(int channel, double ms);     // the pulse width, like PCA9685::set_pwm_ms()
+    void SetChannels(int firstChannel, const unsigned char *pRegisters, int count); // ready register images
+    bool Flush(); // returns false if success, true otherwise
+
+private:
+    I2cDevice *pDevice;
+    float frequencyHz;
+    std::mutex mutex;
+    unsigned char wanted[PCA9685_CHANNELS * 4];  // the Set functions change this
+    unsigned char written[PCA9685_CHANNELS * 4]; // what the board has
+};
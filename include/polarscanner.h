@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include "lasersensor.h"
+#include "servo.h"
+#include "rangingscheduler.h"
+
+// Sweeps the servo without stopping while the sensor on it ranges back-to-back.
+// Each sample goes into the angle bin of where the servo was in the middle of the ranging,
+// that gives a lidar-like polar scan of the whole half circle.
+class PolarScanner
+{
+public:
+    PolarScanner(Servo *pScanServo, LaserSensor *pScanSensor, int binDegrees = 2); // the finest bins
+    void SetScheduler(RangingScheduler *pScheduler); // paused during the scan, the sensor is all ours
+    // the bins are as wide as the sweep in one ranging, so each of them gets a reading
+    bool Scan(int fromDegrees = 0, int toDegrees = 180, float degreesPerSecond = 300.0f); // returns true on error
+    int GetBinCount();
+    int GetBinAngle(int bin);
+    int GetBinDistanceMm(int bin); // the closest valid reading in the bin, -1 if there was none
+    int FindBestGap(int minDistanceCm, int minWidthDegrees); // the middle of the widest gap, -1 if there is none
+
+private:
+    void AddSample(float angle, const RangeSample &sample);
+
+    Servo *pServo;
+    LaserSensor *pSensor;
+    RangingScheduler *pRangingScheduler;
+    int minBinDegrees;
+    int binDegrees; // of the last scan
+    std::vector<int> binDistancesMm;
+    int sampleCount;
+};
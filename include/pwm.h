@@ -1,11 +1,43 @@
 #pragma once
 
+#define PWM_SYSFS "/sys/class/pwm/pwmchip0/"
+#define PWM_CHANNELS 4 // the RP1 has 4 channels: GPIO12, GPIO13, GPIO18, GPIO19
+
+// One channel of the PWM chip. Its period, duty_cycle and enable files are opened once,
+// an update is a single pwrite(), so it can be done at a control loop's rate.
+class PwmChannel
+{
+public:
+    PwmChannel(int channel, const char *sysfsRoot = PWM_SYSFS);
+    ~PwmChannel();
+    bool Open(unsigned int periodNs); // exported and enabled with 0 duty
+    void Close();
+    bool SetDuty(float duty); // 0-1, with the ns resolution of the period
+    bool SetDutyNs(unsigned int dutyNs);
+    bool Enable(bool enable);
+
+private:
+    bool WriteValue(int fd, unsigned int value);
+    int OpenAttribute(const char *name);
+
+    int pwmChannel;
+    char root[128];
+    int periodFd;
+    int dutyFd;
+    int enableFd;
+    unsigned int periodNs;
+};
+
 class PWM
 {
 public:
-    PWM();
-    bool Init(const char *period_ns = "10000000", const char *duty_cycle_ns = "2500000");
+    PWM(const char *sysfsRoot = PWM_SYSFS);
+    ~PWM();
+    bool SetupChannel(int channel, unsigned int periodNs);
+    bool SetDuty(int channel, float duty);
+    PwmChannel *GetChannel(int channel); // NULL if it is not set up
 
 private:
-    bool WriteSYS(const char filename[], const char value[]);
-};
\ No newline at end of file
+    char root[128];
+    PwmChannel *pChannels[PWM_CHANNELS];
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "lasersensor.h"
+
+#define MAX_MEDIAN_WINDOW 9
+
+// the filter chain of a ranging stream; the steps run in this order,
+// a step with its neutral setting is skipped
+struct RangeFilterConfig
+{
+    bool rejectInvalid;           // drop the samples whose range status is not TOF_RANGE_COMPLETE
+    bool passNoTarget;            // a TOF_NO_TARGET sample (e.g. no floor) is the output as it is
+    float minSignalRateMcps;      // drop the samples with a weaker signal (0: keep all)
+    int medianWindow;             // median of the last N samples, 1..MAX_MEDIAN_WINDOW (1: off)
+    float smoothingAlpha;         // exponential smoothing, the weight of the new value 0..1 (1: off)
+    float kalmanProcessNoise;     // 1-D Kalman filter, variance added per sample in mm^2 (0: off)
+    float kalmanMeasurementNoise; // variance of a reading in mm^2
+};
+
+// Filters the samples of one sensor as they come, in constant time per sample
+// and without allocation: the median window is a fixed ring buffer with a
+// sorted copy next to it.
+class RangeFilter
+{
+public:
+    RangeFilter();
+    RangeFilter(const RangeFilterConfig &filterConfig);
+    void SetConfig(const RangeFilterConfig &filterConfig);
+    void Reset();
+    bool Add(const RangeSample &sample); // true if the sample is rejected
+    RangeSample Get() const; // the filtered sample, the time is of the last accepted one
+
+private:
+    float Median(float value);
+
+    RangeFilterConfig config;
+    RangeSample filtered;
+    float window[MAX_MEDIAN_WINDOW]; // in arrival order, a ring buffer
+    float sorted[MAX_MEDIAN_WINDOW];
+    int windowCount;
+    int windowNext;
+    float smoothed;
+    float estimate; // Kalman state and its variance
+    float variance;
+    bool has_value;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "lasersensor.h"
+
+#define MAX_SCHEDULED_SENSORS 8
+
+// Ranges the laser sensors in time slots: the ones that see each other's
+// light (overlapping fields of view) are in different slots, the others
+// range at the same time. The interfering pairs come from the configuration
+// (SetInterference()) or from SelfTest().
+// The sensors must not range continuously, this does their single rangings.
+class RangingScheduler
+{
+public:
+    RangingScheduler(LaserSensor *pSensors[], int count);
+    ~RangingScheduler();
+    void SetInterference(LaserSensor *pSensorA, LaserSensor *pSensorB, bool interfere = true);
+    bool SelfTest(int sampleCount = 10, int toleranceMm = 20); // the scene must not change meanwhile
+    void BuildSlots();
+    int GetSlotCount();
+    int GetSlot(LaserSensor *pSensor); // -1 if it is not scheduled
+    bool RunCycle(RangeSample samples[]); // ranges every slot once, true if a reading failed
+    // the samples of a whole cycle that starts after the call, in the order of pSensors; true on error
+    bool WaitCycle(LaserSensor *pSensors[], int count, RangeSample samples[]);
+    bool Start(); // runs the cycles in its own thread
+    void Stop();
+    float GetSampleRateHz(LaserSensor *pSensor); // the valid samples per second since Start()
+
+private:
+    int IndexOf(LaserSensor *pSensor);
+    void Run();
+
+    LaserSensor *pLaserSensors[MAX_SCHEDULED_SENSORS];
+    int sensorCount;
+    bool interferes[MAX_SCHEDULED_SENSORS][MAX_SCHEDULED_SENSORS];
+    int slotOf[MAX_SCHEDULED_SENSORS];
+    int slotCount;
+    std::atomic<bool> is_running;
+    std::thread worker;
+    std::atomic<unsigned int> validCounts[MAX_SCHEDULED_SENSORS];
+    std::chrono::steady_clock::time_point startTime;
+    std::mutex cycleMutex; // the thread's last cycle
+    std::condition_variable cycleDone;
+    RangeSample cycleSamples[MAX_SCHEDULED_SENSORS];
+    bool is_cycle_failed;
+    unsigned int cycleCount;
+};
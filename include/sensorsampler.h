@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "lasersensor.h"
+#include "lsm6dsox_lis3mdl.h"
+#include "seqlock.h"
+#include "rangefilter.h"
+#include "servo.h"
+
+// the latest sample of every sensor, all taken by the sampler thread;
+// the laser sensors' samples are the filtered ones
+struct SensorSnapshot
+{
+    RangeSample forward;
+    RangeSample left;
+    RangeSample right;
+    RangeSample floor;
+    Lsm6dsoxLis3mdl::vector<int> accelRaw;
+    Lsm6dsoxLis3mdl::vector<int> gyroRaw;
+    Lsm6dsoxLis3mdl::vector<int> compassRaw;
+    std::chrono::steady_clock::time_point accelTime;
+    std::chrono::steady_clock::time_point gyroTime;
+    std::chrono::steady_clock::time_point compassTime;
+};
+
+// Its thread reads the sensors at a steady rate and publishes what they have,
+// so the control logic gets the latest values without any bus traffic or waiting.
+// The laser sensors should range continuously, it only collects their results.
+class SensorSampler
+{
+public:
+    SensorSampler(LaserSensor *pFwrdSensor, LaserSensor *pLftSensor, LaserSensor *pRghtSensor,
+                  LaserSensor *pFlrSensor, Lsm6dsoxLis3mdl *pImu);
+    ~SensorSampler();
+    bool Start(int periodMs = 10);
+    void Stop();
+    SensorSnapshot GetSnapshot() const;
+    void SetFilter(LaserSensor *pSensor, const RangeFilterConfig &config); // before Start()
+    void SetServo(Servo *pSensorServo); // the forward sensor is on it, before Start()
+
+private:
+    void Run();
+
+    LaserSensor *pForwardSensor;
+    LaserSensor *pLeftSensor;
+    LaserSensor *pRightSensor;
+    LaserSensor *pFloorSensor;
+    Lsm6dsoxLis3mdl *pLsmLis;
+    Servo *pServo;
+    RangeFilter filters[4]; // forward, left, right, floor
+    int samplingPeriodMs;
+    std::atomic<bool> is_running;
+    std::thread worker;
+    SeqLock<SensorSnapshot> snapshot;
+};
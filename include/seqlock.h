@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+
+// A value written by one thread and read by any number of threads without
+// locking: the writer never waits, a reader retries if the value changed
+// while it was copying it. T must be copyable as plain memory.
+template <typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+public:
+    SeqLock() : sequence(0), value() {}
+
+    void Write(const T &newValue)
+    { // one writer at a time
+        unsigned int s = this->sequence.load(std::memory_order_relaxed);
+        this->sequence.store(s + 1, std::memory_order_relaxed); // odd: being written
+        std::atomic_thread_fence(std::memory_order_release);
+        this->value = newValue;
+        this->sequence.store(s + 2, std::memory_order_release);
+    }
+
+    T Read() const
+    {
+        T copy;
+        unsigned int before, after;
+
+        do
+        {
+            before = this->sequence.load(std::memory_order_acquire);
+            copy = this->value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = this->sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        return copy;
+    }
+
+private:
+    std::atomic<unsigned int> sequence;
+    T value;
+};
@@ -1,12 +1,26 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+
 class Servo
 {
 public:
-    Servo(int pin);
-    void Move(int position);
+    Servo(int pin, float msPer60Degrees = 100.0f, int settleMs = 20);
+    int Move(int position); // returns without waiting, the estimated ms until it gets there
+    void SetSpeedModel(float msPer60Degrees, int settleMs);
+    int GetRemainingMs(); // 0 once the servo has settled
+    bool IsSettled();
+    void WaitSettled();
+    std::chrono::steady_clock::time_point GetSettledTime();
+    float GetAngleAt(std::chrono::steady_clock::time_point time); // the estimated position at that time
 
 private:
     int pca9685Pin;
     int lastPosition;
-};
\ No newline at end of file
+    float msPer60Degrees; // no-load speed, the SG90 does 60 degrees in 0.1s at 4.8V
+    int settleMs;         // the ringing at the end of a move
+    std::atomic<std::chrono::steady_clock::time_point> settledTime; // the sampler thread reads it too
+    std::chrono::steady_clock::time_point moveStartTime;
+    float moveFromPosition; // where the last move started from
+};
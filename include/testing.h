@@ -11,6 +11,9 @@ public:
     void TestSpeechToText();
     void TestCompass();
     void TestGyro();
+    void TestI2CThroughput(int slaveAddress, int readCount);
+    void TestLaserSensorInitTime(LaserSensor *pSensor, int repeatCount);
+    void TestPwmChannel(int updateCount);
 
 private:
     void TestLaserSensor(const char *text, LaserSensor *pSensor, int repeatCount);
@@ -1,15 +1,19 @@
 #pragma once
 
+#include "pca9685shadow.h"
+
+// The outputs are only staged in the shadow registers,
+// Flush() them once all the motors are set.
 class TTMotor
 {
 public:
-    TTMotor(PiPCA9685::PCA9685 *pPCA9685, int pSpeed, int pForward, int pBackward);
+    TTMotor(Pca9685Shadow *pPCA9685, int pSpeed, int pForward, int pBackward);
     void Stop();
     void MoveForward(int speed = 19);
     void MoveBackward(int speed = 19);
 
 private:
-    PiPCA9685::PCA9685 *pPCA;
+    Pca9685Shadow *pPCA;
     int pinSpeed;
     int pinForWard;
     int pinBackward;
@@ -1,13 +1,29 @@
 #pragma once
 
+#include <chrono>
+#include "lasersensor.h" // RangeSample
+
+#define US_NO_ECHO_WIDTH_US 36000 // the HC-SR04 ends the pulse at about 38ms when no echo came
+
 class UsSensor
 {
 public:
-    UsSensor(int triggerGpio, int echoGpio);
-    float GetDistanceCm();
+    UsSensor(int triggerGpio, int echoGpio, int timeoutMs = 40);
+    float GetDistanceCm(); // -1 if there is no valid echo
+    RangeSample GetSample(); // waits for the echo, distanceMm is TOF_TIMEOUT if there is none
+    // the same in two steps, so the caller doesn't have to wait
+    bool StartMeasurement(); // sends the trigger pulse, returns true on error
+    bool IsMeasurementDone(RangeSample &sample); // doesn't wait, fills the sample when it is done (TOF_NO_TARGET if there was no echo)
     void ReleaseGpioLines();
 
 private:
+    bool ReadEchoEvents(int waitUs, RangeSample &sample);
+
     struct gpiod_line *pLineTrigger;
     struct gpiod_line *pLineEcho;
-};
\ No newline at end of file
+    int echoTimeoutMs; // the HC-SR04 gives up after about 38ms
+    bool is_measuring;
+    bool has_rising_edge;
+    std::chrono::steady_clock::time_point triggerTime;
+    std::chrono::steady_clock::time_point risingEdgeTime;
+};
@@ -2,7 +2,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <chrono>
-#include <PCA9685.h>
+#include <array>
+#include <math.h>
 #include "car.h"
 #include "texttospeech.h"
 #include "lsm6dsox_lis3mdl.h" 
@@ -23,6 +24,74 @@
 #define ttRightBackForwardPin 4
 #define ttRightBackBackwardPin 3
 
+#define ttMaxTicks 4095     // full speed, the speed pins have the 12 bits of the PCA9685
+#define ttMotorChannels 12  // the motors use the channels 0-11
+#define ttDirectionOn 15    // ms, the direction pins are 1 with this
+#define ttDirectionOff 1    // ms, and 0 with this
+
+// the register images of the motors' channels for every motion, built at compile time:
+// a motion change is one burst write of a ready buffer (only the speeds are filled in),
+// and the board changes all the outputs at the end of the write, so the wheels never disagree on the way
+typedef std::array<unsigned char, ttMotorChannels * 4> MotionFrame;
+
+struct MotorPins
+{
+    int speed;
+    int forward;
+    int backward;
+    bool is_left;
+};
+
+constexpr MotorPins motorPins[] = {
+    {ttLeftFrontSpeedPin, ttLeftFrontForwardPin, ttLeftFrontBackwardPin, true},
+    {ttRightFrontSpeedPin, ttRightFrontForwardPin, ttRightFrontBackwardPin, false},
+    {ttLeftBackSpeedPin, ttLeftBackForwardPin, ttLeftBackBackwardPin, true},
+    {ttRightBackSpeedPin, ttRightBackForwardPin, ttRightBackBackwardPin, false}};
+
+constexpr int PwmTicks(int ms)
+{ // the pulse width in ms in ticks of the 4096 ticks long period
+    return ms * 4096 * PCA9685_FREQUENCY_HZ / 1000;
+}
+
+constexpr void SetFrameTicks(MotionFrame &frame, int channel, int ticks)
+{ // ON at 0, OFF after the pulse width
+    frame[channel * 4] = 0;
+    frame[channel * 4 + 1] = 0;
+    frame[channel * 4 + 2] = (unsigned char)(ticks & 0xff);
+    frame[channel * 4 + 3] = (unsigned char)((ticks >> 8) & 0x0f);
+}
+
+constexpr MotionFrame MakeMotionFrame(Motion motion)
+{ // the speeds are 0
+    MotionFrame frame = {};
+    for (const MotorPins &pins : motorPins)
+    {
+        bool is_forward = motion == Motion::FORWARD || motion == Motion::STOP ||
+                          (motion == Motion::SPIN_LEFT && !pins.is_left) || (motion == Motion::SPIN_RIGHT && pins.is_left);
+        SetFrameTicks(frame, pins.speed, 0);
+        SetFrameTicks(frame, pins.forward, PwmTicks(is_forward ? ttDirectionOn : ttDirectionOff));
+        SetFrameTicks(frame, pins.backward, PwmTicks(is_forward ? ttDirectionOff : ttDirectionOn));
+    }
+    return frame;
+}
+
+constexpr bool IsMotorPinMapComplete()
+{ // every channel of the frame belongs to exactly one pin
+    int used = 0;
+    for (const MotorPins &pins : motorPins)
+        used |= (1 << pins.speed) | (1 << pins.forward) | (1 << pins.backward);
+    return used == (1 << ttMotorChannels) - 1;
+}
+static_assert(IsMotorPinMapComplete(), "the motor pins must be the channels 0-11");
+
+constexpr std::array<MotionFrame, (int)Motion::COUNT> motionFrames = []()
+{
+    std::array<MotionFrame, (int)Motion::COUNT> frames = {};
+    for (int motion = 0; motion < (int)Motion::COUNT; motion++)
+        frames[motion] = MakeMotionFrame((Motion)motion);
+    return frames;
+}();
+
 extern bool debug;
 extern TextToSpeech *pTextToSpeech;
 extern Lsm6dsoxLis3mdl *pLsmLis;
@@ -45,26 +114,30 @@ enum class Command
 
 Command currentCommand = Command::NONE;
 
-Car::Car(PiPCA9685::PCA9685 *pPCA9685, LaserSensor *pLftSensor, LaserSensor *pRghtSensor,
+Car::Car(Pca9685Shadow *pPCA9685, LaserSensor *pLftSensor, LaserSensor *pRghtSensor,
          LaserSensor *pFwrdSensor, LaserSensor *pFlrSensor, Servo *pTurningServo)
 {
     this->is_moving = false;
     this->last_turn_to_left = true;
-    this->speed = 11;                 // 9 is the 50% of maximum
+    this->duty = 0.55f;               // of the full speed
+    this->turn_duty = 0.5f;
     this->max_floor_distance = 18;   // cm
     this->min_forward_distance = 30; // cm
+    this->max_sample_age_ms = 50;    // older sampled values are read again
+    this->min_gap_degrees = 20;      // a narrower gap is no way for the car
+    this->pSampler = NULL;
+    this->pScanner = NULL;
+    this->pRangingScheduler = NULL;
+    this->pHeading = NULL;
+    this->pMotorPwm = NULL;
+    this->leftPwmChannel = -1;
+    this->rightPwmChannel = -1;
     this->pPCA = pPCA9685;
     this->pLeftSensor = pLftSensor;
     this->pRightSensor = pRghtSensor;
     this->pForwardSensor = pFwrdSensor;
     this->pFloorSensor = pFlrSensor;
     this->pServo = pTurningServo;
-
-    // initalize TT motors
-    this->pLeftFrontMotor = new TTMotor(this->pPCA, ttLeftFrontSpeedPin, ttLeftFrontForwardPin, ttLeftFrontBackwardPin);
-    this->pRightFrontMotor = new TTMotor(this->pPCA, ttRightFrontSpeedPin, ttRightFrontForwardPin, ttRightFrontBackwardPin);
-    this->pLeftBackMotor = new TTMotor(this->pPCA, ttLeftBackSpeedPin, ttLeftBackForwardPin, ttLeftBackBackwardPin);
-    this->pRightBackMotor = new TTMotor(this->pPCA, ttRightBackSpeedPin, ttRightBackForwardPin, ttRightBackBackwardPin);
     this->Stop();
 }
 
@@ -73,12 +146,57 @@ bool Car::IsMoving()
     return this->is_moving;
 }
 
+void Car::Drive(Motion motion, int leftTicks, int rightTicks)
+{ // all the motors at once
+    MotionFrame frame = motionFrames[(int)motion];
+
+    if (this->pMotorPwm == NULL)
+    {
+        for (const MotorPins &pins : motorPins)
+            SetFrameTicks(frame, pins.speed, pins.is_left ? leftTicks : rightTicks);
+    }
+    this->pPCA->SetChannels(0, frame.data(), ttMotorChannels);
+    this->pPCA->Flush();
+
+    if (this->pMotorPwm != NULL)
+    { // the directions are set already
+        this->pMotorPwm->SetDuty(this->leftPwmChannel, (float)leftTicks / ttMaxTicks);
+        this->pMotorPwm->SetDuty(this->rightPwmChannel, (float)rightTicks / ttMaxTicks);
+    }
+}
+
+void Car::SetMotorDuty(float leftDuty, float rightDuty)
+{ // -1 (full speed backward) - 1 (full speed forward) for each side
+    leftDuty = leftDuty < -1.0f ? -1.0f : (leftDuty > 1.0f ? 1.0f : leftDuty);
+    rightDuty = rightDuty < -1.0f ? -1.0f : (rightDuty > 1.0f ? 1.0f : rightDuty);
+    int leftTicks = (int)lroundf(fabsf(leftDuty) * ttMaxTicks);
+    int rightTicks = (int)lroundf(fabsf(rightDuty) * ttMaxTicks);
+    Motion motion = Motion::STOP;
+
+    if (leftTicks != 0 || rightTicks != 0)
+    {
+        if (leftDuty >= 0)
+            motion = rightDuty >= 0 ? Motion::FORWARD : Motion::SPIN_RIGHT;
+        else
+            motion = rightDuty >= 0 ? Motion::SPIN_LEFT : Motion::BACKWARD;
+    }
+    this->Drive(motion, leftTicks, rightTicks);
+}
+
+void Car::SetHardwarePwm(PWM *pPwm, int leftChannel, int rightChannel)
+{ // the speed pins of the left and of the right motors on the Raspberry's PWM channels,
+  // the direction pins stay on the PCA9685
+    this->pMotorPwm = pPwm;
+    this->leftPwmChannel = leftChannel;
+    this->rightPwmChannel = rightChannel;
+}
+
 void Car::SetSpeed(int percent)
 {
-    this->speed = (int)((((double)percent) / 100.0) * 19.0); // 19 max speed
+    this->duty = percent / 100.0f;
 
     if (::debug)
-        printf("Car speed is set to absolute %d\n", this->speed);
+        printf("Car speed is set to %.3f duty\n", this->duty);
 }
 
 void Car::MoveForward()
@@ -90,10 +208,7 @@ void Car::MoveForward()
     this->is_moving = true;
 
     // drive TT motors
-    this->pLeftFrontMotor->MoveForward(this->speed);
-    this->pLeftBackMotor->MoveForward(this->speed);
-    this->pRightFrontMotor->MoveForward(this->speed);
-    this->pRightBackMotor->MoveForward(this->speed);
+    this->SetMotorDuty(this->duty, this->duty);
 }
 
 void Car::MoveBackward()
@@ -105,10 +220,7 @@ void Car::MoveBackward()
     this->is_moving = true;
 
     // drive TT motors
-    this->pLeftFrontMotor->MoveBackward(this->speed);
-    this->pLeftBackMotor->MoveBackward(this->speed);
-    this->pRightFrontMotor->MoveBackward(this->speed);
-    this->pRightBackMotor->MoveBackward(this->speed);
+    this->SetMotorDuty(-this->duty, -this->duty);
 }
 
 void Car::Stop()
@@ -121,25 +233,86 @@ void Car::Stop()
         pTextToSpeech->Talk("Stopping.");
         this->is_moving = false;
         // stop TT motors
+        this->SetMotorDuty(0, 0);
+    }
+}
+
+bool Car::IsFloorAhead(int floorDistance)
+{ // a failed reading (negative distance) is not taken as floor
+    return (floorDistance >= 0 && floorDistance <= this->max_floor_distance);
+}
+
+void Car::SetSampler(SensorSampler *pSensorSampler)
+{ // with a sampler, the distances are taken from its latest snapshot if they are recent enough
+    this->pSampler = pSensorSampler;
+}
+
+void Car::SetScanner(PolarScanner *pPolarScanner)
+{ // with a scanner, the direction is chosen from a full scan instead of the first good step
+    this->pScanner = pPolarScanner;
+}
 
-        this->pLeftFrontMotor->Stop();
-        this->pRightFrontMotor->Stop();
-        this->pLeftBackMotor->Stop();
-        this->pRightBackMotor->Stop();
+void Car::SetScheduler(RangingScheduler *pScheduler)
+{ // with a scheduler, the sensors are read in its slots when the snapshot is not good enough
+    this->pRangingScheduler = pScheduler;
+}
+
+void Car::SetHeadingEstimator(HeadingEstimator *pEstimator)
+{ // with an estimator, the turns are measured by its heading instead of sampling the gyro in the loop
+    this->pHeading = pEstimator;
+}
+
+bool Car::IsFresh(const RangeSample &sample)
+{
+    return sample.distanceMm != TOF_NOT_READY && sample.AgeMs() <= this->max_sample_age_ms;
+}
+
+int Car::GetFloorDistanceCm()
+{
+    if (this->pSampler != NULL)
+    {
+        RangeSample sample = this->pSampler->GetSnapshot().floor;
+        if (this->IsFresh(sample))
+            return sample.DistanceCm();
     }
+
+    return this->pFloorSensor->GetDistanceCm();
 }
 
 bool Car::IsTheRoadClear()
 { // returns true if the road ahead is clear by all 3 forward facing sensors
     bool ret = false;
-    int dist = 0;
+    LaserSensor *pSensors[] = {this->pForwardSensor, this->pLeftSensor, this->pRightSensor};
+    int distances[3];
     pServo->Move(90); // set servo to middle position facing forward
 
-    if ((dist = this->pForwardSensor->GetDistanceCm()) > this->min_forward_distance)
+    // the forward sensor is on the servo: its reading counts only from after the servo got there
+    SensorSnapshot snapshot;
+    if (this->pSampler != NULL && this->IsFresh((snapshot = this->pSampler->GetSnapshot()).forward) &&
+        snapshot.forward.time >= pServo->GetSettledTime() && this->IsFresh(snapshot.left) && this->IsFresh(snapshot.right))
+    { // no need to wait for the sensors
+        distances[0] = snapshot.forward.DistanceCm();
+        distances[1] = snapshot.left.DistanceCm();
+        distances[2] = snapshot.right.DistanceCm();
+    }
+    else if (this->pRangingScheduler != NULL)
+    { // in the scheduler's slots, the interfering ones don't range together
+        RangeSample samples[3];
+        pServo->WaitSettled();
+        this->pRangingScheduler->WaitCycle(pSensors, 3, samples);
+        for (int i = 0; i < 3; i++)
+            distances[i] = samples[i].DistanceCm();
+    }
+    else
+    { // the three of them measure at the same time
+        pServo->WaitSettled();
+        LaserSensor::GetDistancesCm(pSensors, 3, distances);
+    }
+    if (distances[0] > this->min_forward_distance)
     {
-        if ((dist = this->pLeftSensor->GetDistanceCm()) > this->min_forward_distance)
+        if (distances[1] > this->min_forward_distance)
         {
-            if ((dist = this->pRightSensor->GetDistanceCm()) > this->min_forward_distance)
+            if (distances[2] > this->min_forward_distance)
             {
                 if (::debug)
                     printf("Road is clear\n");
@@ -148,19 +321,19 @@ bool Car::IsTheRoadClear()
             else
             {
                 if (::debug)
-                    printf("Road is not clear: right distance: %dcm\n", dist);
+                    printf("Road is not clear: right distance: %dcm\n", distances[2]);
             }
         }
         else
         {
             if (::debug)
-                printf("Road is not clear: left distance: %dcm\n", dist);
+                printf("Road is not clear: left distance: %dcm\n", distances[1]);
         }
     }
     else
     {
         if (::debug)
-            printf("Road is not clear: forward distance: %dcm\n", dist);
+            printf("Road is not clear: forward distance: %dcm\n", distances[0]);
     }
 
     if (!ret)
@@ -178,6 +351,9 @@ void Car::Turn(int direction)
   //
   // I also tried to use various "fusion" algorithms to improve the results, that is,
   // Mahony, Madgwick, and NXPfusion but none of them made any significant improvement.
+    if (direction == 90)
+        return; // there is nothing to turn, no gyro goal could be reached
+
     printf("**********Turning starts\n");
 
     // turn TT motors
@@ -186,28 +362,27 @@ void Car::Turn(int direction)
 
     this->MoveBackward();
     usleep(200000); // delay 200ms
-    pLsmLis->CalculateGyroAveBias(); // this takes 100ms
+    if (this->pHeading == NULL)
+        pLsmLis->CalculateGyroAveBias(); // this takes 100ms
+    else
+        usleep(100000); // backing up the same way, the estimator has its bias already
     
     if (direction > 90) // turning left
     {
         pTextToSpeech->Talk("Turning left");
         this->last_turn_to_left = true;
-        this->pLeftFrontMotor->MoveBackward(10);
-        this->pLeftBackMotor->MoveBackward(10);
-        this->pRightFrontMotor->MoveForward(10);
-        this->pRightBackMotor->MoveForward(10);
+        this->SetMotorDuty(-this->turn_duty, this->turn_duty);
     }
     else // turning right
     {
         pTextToSpeech->Talk("Turning right");
         this->last_turn_to_left = false;
-        this->pLeftFrontMotor->MoveForward(10);
-        this->pLeftBackMotor->MoveForward(10);
-        this->pRightFrontMotor->MoveBackward(10);
-        this->pRightBackMotor->MoveBackward(10);
+        this->SetMotorDuty(this->turn_duty, -this->turn_duty);
     }
     double gyroGoal = (double) (direction - 90); // for Gyro, a left turn is pozitive, and right turn is negative
     pLsmLis->lastGyroAngles = { 0, 0, 0 };
+    if (this->pHeading != NULL)
+        this->pHeading->ResetHeading();
     // now, the car is continuously turning
 
     std::chrono::steady_clock::time_point turnStartTime = std::chrono::steady_clock::now();
@@ -224,11 +399,14 @@ void Car::Turn(int direction)
         if (::debug)
             printf("Checking for obstacles\n");
 
-        if (this->IsTheRoadClear()) // this takes at least 100ms, at most 360ms
+        if (this->IsTheRoadClear()) // the three sensors range at the same time, this takes about one ranging
         {
             std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
             std::chrono::milliseconds duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-            pLsmLis->lastGyroAngles = pLsmLis->GetGyroAngles(duration.count(), pLsmLis->lastGyroAngles);
+            if (this->pHeading != NULL)
+                pLsmLis->lastGyroAngles.z = this->pHeading->GetHeading(); // every sample of the turn is in it
+            else
+                pLsmLis->lastGyroAngles = pLsmLis->GetGyroAngles(duration.count(), pLsmLis->lastGyroAngles);
             // printf("Road is clear: current turn angle is %f, goal is %f elapsed time:%dms\n",
             //         pLsmLis->lastGyroAngles.z, gyroGoal, duration.count());
             if((gyroGoal > 0 && pLsmLis->lastGyroAngles.z >= gyroGoal) ||
@@ -243,7 +421,8 @@ void Car::Turn(int direction)
         {
             std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
             std::chrono::milliseconds duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-            pLsmLis->lastGyroAngles = pLsmLis->GetGyroAngles(duration.count(), pLsmLis->lastGyroAngles);
+            if (this->pHeading == NULL)
+                pLsmLis->lastGyroAngles = pLsmLis->GetGyroAngles(duration.count(), pLsmLis->lastGyroAngles);
             // printf("Road is NOT clear: current turn angle is %f, goal is %f elapsed time:%dms\n",
             //         pLsmLis->lastGyroAngles.z, gyroGoal, duration.count());
         }
@@ -262,31 +441,52 @@ void Car::FindDirection()
 
     // to make sure that we don't try to turn all the time in the same direction
     int *directions = this->last_turn_to_left ? directions1 : directions2;
+    int direction = -1;
 
-    for (int i = 0; i < size; i++)
+    if (this->pScanner != NULL)
+    { // the best gap of the whole half circle
+        if (!this->pScanner->Scan())
+            direction = this->pScanner->FindBestGap(this->min_forward_distance, this->min_gap_degrees);
+    }
+    else
     {
-        pServo->Move(directions[i]);
-        if (this->pForwardSensor->GetDistanceCm() > this->min_forward_distance)
+        // fewer, but more reliable readings while scanning
+        this->pForwardSensor->SetProfile(TOF_PROFILE_HIGH_ACCURACY);
+        for (int i = 0; i < size; i++)
         {
-            if (::debug)
-                printf("Forward sensor found way forward in direction %d, that is: %s\n",
-                       directions[i], (directions[i] > 90 ? "left" : "right"));
-            pServo->Move(90); // turn servo ahead
-            this->Turn(directions[i]);
-            if (this->IsTheRoadClear())
+            pServo->Move(directions[i]);
+            pServo->WaitSettled();
+            // a reading without a valid range status is no way forward (those give the far outliers)
+            RangeSample sample = this->pForwardSensor->GetSample();
+            if (sample.IsValid() && sample.DistanceCm() > this->min_forward_distance)
             {
-                if (this->pFloorSensor->GetDistanceCm() <= this->max_floor_distance)
-                {
-                    this->MoveForward();
-                }
-                else
-                {
-                    if (::debug)
-                        printf("No floor: distance: %d\n", this->pFloorSensor->GetDistanceCm());
-                    pTextToSpeech->Talk("No floor ahead");
-                }
+                direction = directions[i];
+                break;
+            }
+        }
+        this->pForwardSensor->SetProfile(TOF_PROFILE_HIGH_SPEED);
+    }
+
+    if (direction >= 0)
+    {
+        if (::debug)
+            printf("Forward sensor found way forward in direction %d, that is: %s\n",
+                   direction, (direction > 90 ? "left" : direction < 90 ? "right" : "straight ahead"));
+        pServo->Move(90); // turn servo ahead, it gets there while the car turns
+        this->Turn(direction); // straight ahead (90) is no turn
+        if (this->IsTheRoadClear())
+        {
+            int floorDistance = this->GetFloorDistanceCm();
+            if (this->IsFloorAhead(floorDistance))
+            {
+                this->MoveForward();
+            }
+            else
+            {
+                if (::debug)
+                    printf("No floor: distance: %d\n", floorDistance);
+                pTextToSpeech->Talk("No floor ahead");
             }
-            break;
         }
     }
 }
@@ -298,12 +498,12 @@ void Car::MovingStepForward()
     if (::debug)
         printf("MovingStepForward\n");
 
-    float floorDistance = this->pFloorSensor->GetDistanceCm();
+    int floorDistance = this->GetFloorDistanceCm();
 
-    if (floorDistance > this->max_floor_distance)
+    if (!this->IsFloorAhead(floorDistance))
     {
         if (::debug)
-            printf("No floor: distance: %d\n", this->pFloorSensor->GetDistanceCm());
+            printf("No floor: distance: %d\n", floorDistance);
 
         pTextToSpeech->Talk("No floor ahead");
         if (this->is_moving)
@@ -336,12 +536,12 @@ void Car::FollowVoiceCommands()
     { // no command, so just check the floor and check for obstacles
         if (this->IsMoving())
         {
-            float floorDistance = this->pFloorSensor->GetDistanceCm();
+            int floorDistance = this->GetFloorDistanceCm();
 
-            if (floorDistance > this->max_floor_distance)
+            if (!this->IsFloorAhead(floorDistance))
             {
                 if (::debug)
-                    printf("No floor: distance: %d\n", this->pFloorSensor->GetDistanceCm());
+                    printf("No floor: distance: %d\n", floorDistance);
                 pTextToSpeech->Talk("No floor ahead");
                 if (this->is_moving)
                     this->Stop();
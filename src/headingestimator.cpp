@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <vector>
+#include <chrono>
+#include "headingestimator.h"
+
+extern bool debug;
+
+HeadingEstimator::HeadingEstimator(Lsm6dsoxLis3mdl *pImu)
+{
+    this->pLsmLis = pImu;
+    this->readPeriodMs = 10;
+    this->is_running = false;
+    this->integratedHeading = 0;
+    this->rateDps = 0;
+    this->headingZero = 0;
+    this->biasDps = 0;
+    this->is_calibrating = false;
+    this->calibrationSum = 0;
+    this->calibrationCount = 0;
+}
+
+HeadingEstimator::~HeadingEstimator()
+{
+    this->Stop();
+}
+
+bool HeadingEstimator::Start(int periodMs)
+{ // returns false if success, true otherwise
+    if (this->is_running)
+        return false;
+
+    if (this->pLsmLis->StartFifo())
+    {
+        printf("ERROR:%s(): can't start the IMU FIFO\n", __func__);
+        return true;
+    }
+    this->readPeriodMs = periodMs;
+    this->is_running = true;
+    this->worker = std::thread(&HeadingEstimator::Run, this);
+
+    return false;
+}
+
+void HeadingEstimator::Stop()
+{
+    if (!this->is_running)
+        return;
+
+    this->is_running = false;
+    if (this->worker.joinable())
+        this->worker.join();
+    this->pLsmLis->StopFifo();
+}
+
+bool HeadingEstimator::CalibrateBias(int durationMs)
+{ // returns false if success, true otherwise
+    {
+        std::lock_guard<std::mutex> lock(this->calibrationMutex);
+        this->calibrationSum = 0;
+        this->calibrationCount = 0;
+        this->is_calibrating = true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+
+    std::lock_guard<std::mutex> lock(this->calibrationMutex);
+    this->is_calibrating = false;
+    if (this->calibrationCount == 0)
+    {
+        printf("ERROR:%s(): no gyro samples, is the estimator running?\n", __func__);
+        return true;
+    }
+    this->biasDps = this->biasDps + this->calibrationSum / this->calibrationCount;
+    if (::debug)
+        printf("Gyro bias: %fdps from %d samples\n", this->biasDps.load(), this->calibrationCount);
+
+    return false;
+}
+
+void HeadingEstimator::ResetHeading()
+{
+    this->headingZero = this->integratedHeading.load();
+}
+
+double HeadingEstimator::GetHeading()
+{
+    return this->integratedHeading - this->headingZero;
+}
+
+double HeadingEstimator::GetRateDps()
+{
+    return this->rateDps;
+}
+
+void HeadingEstimator::Run()
+{
+    std::vector<Lsm6dsoxLis3mdl::FifoSample> samples;
+    uint32_t lastTimestamp = 0;
+    bool has_last = false;
+
+    while (this->is_running)
+    {
+        samples.clear();
+        this->pLsmLis->ReadFifo(samples);
+
+        double heading = this->integratedHeading;
+        for (const Lsm6dsoxLis3mdl::FifoSample &sample : samples)
+        {
+            if (!(sample.fresh & 2))
+                continue;
+            double rate = this->pLsmLis->GyroRawToDps(sample.gyro).z - this->biasDps;
+            // the time between the samples, the way the chip measured it (wraps around correctly)
+            double seconds = has_last ? (uint32_t)(sample.timestamp - lastTimestamp) * LSM6DSOX_TIMESTAMP_LSB_US / 1000000.0 : 0;
+            lastTimestamp = sample.timestamp;
+            has_last = true;
+
+            {
+                std::lock_guard<std::mutex> lock(this->calibrationMutex);
+                if (this->is_calibrating)
+                {
+                    this->calibrationSum += rate;
+                    this->calibrationCount++;
+                    continue;
+                }
+            }
+            heading += rate * seconds;
+            this->rateDps = rate;
+        }
+        this->integratedHeading = heading;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(this->readPeriodMs));
+    }
+}
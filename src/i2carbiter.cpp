@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include "i2carbiter.h"
+
+I2cArbiter::I2cArbiter()
+{
+    this->is_running = false;
+}
+
+I2cArbiter::~I2cArbiter()
+{
+    this->Stop();
+}
+
+bool I2cArbiter::Start()
+{ // returns false if success, true otherwise
+    std::lock_guard<std::mutex> lock(this->queueMutex);
+
+    if (!this->is_running)
+    {
+        this->is_running = true;
+        this->worker = std::thread(&I2cArbiter::Run, this);
+    }
+
+    return false;
+}
+
+void I2cArbiter::Stop()
+{ // the transactions already queued are still done
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        this->is_running = false;
+    }
+    this->queueChanged.notify_all();
+
+    if (this->worker.joinable())
+        this->worker.join();
+}
+
+std::future<int> I2cArbiter::Submit(I2cPriority priority, std::function<int()> transaction)
+{
+    Transaction t;
+    t.work = transaction;
+    std::future<int> result = t.done.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        if (this->is_running)
+        {
+            this->queues[(int)priority].push_back(std::move(t));
+            this->queueChanged.notify_one();
+            return result;
+        }
+    }
+
+    // nobody owns the bus, so the caller does it
+    Perform(t);
+    return result;
+}
+
+int I2cArbiter::Execute(I2cPriority priority, std::function<int()> transaction)
+{ // submits the transaction and waits for its result
+    if (std::this_thread::get_id() == this->worker.get_id())
+        return transaction(); // a transaction that is part of the running one
+
+    return this->Submit(priority, transaction).get();
+}
+
+void I2cArbiter::Perform(Transaction &transaction)
+{
+    try
+    {
+        transaction.done.set_value(transaction.work());
+    }
+    catch (...)
+    {
+        transaction.done.set_exception(std::current_exception());
+    }
+}
+
+void I2cArbiter::Run()
+{
+    while (true)
+    {
+        Transaction next;
+        {
+            std::unique_lock<std::mutex> lock(this->queueMutex);
+            int priority = 0;
+
+            while (true)
+            {
+                for (priority = 0; priority < (int)I2cPriority::COUNT; priority++)
+                {
+                    if (!this->queues[priority].empty())
+                        break;
+                }
+
+                if (priority < (int)I2cPriority::COUNT || !this->is_running)
+                    break;
+
+                this->queueChanged.wait(lock);
+            }
+
+            if (priority == (int)I2cPriority::COUNT)
+                break; // stopped and nothing is left to do
+
+            next = std::move(this->queues[priority].front());
+            this->queues[priority].pop_front();
+        }
+
+        Perform(next);
+    }
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include "i2cdevice.h"
+
+I2cDevice::I2cDevice(int slaveAddress, int channel)
+{
+    this->i2cChannel = channel;
+    this->i2cSlaveAddress = slaveAddress;
+    this->dev.file = -1;
+    this->dev.addr = -1;
+    this->pArbiter = NULL;
+    this->priority = I2cPriority::RANGING;
+}
+
+I2cDevice::~I2cDevice()
+{
+    i2cCloseDev(&this->dev);
+}
+
+bool I2cDevice::Open()
+{ // returns false if success, true otherwise
+    std::lock_guard<std::recursive_mutex> lock(this->mutex);
+    bool ret = false;
+
+    if (this->dev.file < 0)
+    {
+        ret = i2cOpenDev(&this->dev, this->i2cChannel, this->i2cSlaveAddress);
+        if (ret)
+            printf("ERROR:%s(): can't open i2c device 0x%x\n", __func__, this->i2cSlaveAddress);
+    }
+
+    return ret;
+}
+
+bool I2cDevice::SetAddress(int newSlaveAddress)
+{ // only moves the handle, the device must already answer at the new address
+    std::lock_guard<std::recursive_mutex> lock(this->mutex);
+    bool ret = false;
+
+    if (this->dev.file >= 0)
+        ret = i2cSetAddressDev(&this->dev, newSlaveAddress);
+
+    if (!ret)
+        this->i2cSlaveAddress = newSlaveAddress;
+
+    return ret;
+}
+
+int I2cDevice::GetAddress()
+{
+    return this->i2cSlaveAddress;
+}
+
+void I2cDevice::SetArbiter(I2cArbiter *pI2cArbiter, I2cPriority i2cPriority)
+{
+    this->pArbiter = pI2cArbiter;
+    this->priority = i2cPriority;
+}
+
+int I2cDevice::Transact(std::function<int(I2CDEV *)> transaction)
+{ // does the transaction and returns its result
+    std::function<int()> work = [this, transaction]()
+    {
+        std::lock_guard<std::recursive_mutex> lock(this->mutex);
+        return transaction(&this->dev);
+    };
+
+    if (this->pArbiter != NULL)
+        return this->pArbiter->Execute(this->priority, work);
+
+    return work();
+}
+
+std::future<int> I2cDevice::SubmitTransaction(std::function<int(I2CDEV *)> transaction)
+{ // queues the transaction, the future gets its result
+    std::function<int()> work = [this, transaction]()
+    {
+        std::lock_guard<std::recursive_mutex> lock(this->mutex);
+        return transaction(&this->dev);
+    };
+
+    if (this->pArbiter != NULL)
+        return this->pArbiter->Submit(this->priority, work);
+
+    return std::async(std::launch::deferred, work);
+}
+
+unsigned char I2cDevice::ReadReg(unsigned char reg)
+{
+    return (unsigned char)this->Transact([reg](I2CDEV *pDev)
+                                         { return (int)readRegDev(pDev, reg); });
+}
+
+unsigned short I2cDevice::ReadReg16(unsigned char reg)
+{
+    return (unsigned short)this->Transact([reg](I2CDEV *pDev)
+                                          { return (int)readReg16Dev(pDev, reg); });
+}
+
+bool I2cDevice::ReadMulti(unsigned char reg, unsigned char *pBuffer, int count)
+{
+    return this->Transact([reg, pBuffer, count](I2CDEV *pDev)
+                          { return readMultiDev(pDev, reg, pBuffer, count); }) != 0;
+}
+
+void I2cDevice::WriteReg(unsigned char reg, unsigned char value)
+{
+    this->Transact([reg, value](I2CDEV *pDev)
+                   { writeRegDev(pDev, reg, value); return 0; });
+}
+
+void I2cDevice::WriteReg16(unsigned char reg, unsigned short value)
+{
+    this->Transact([reg, value](I2CDEV *pDev)
+                   { writeReg16Dev(pDev, reg, value); return 0; });
+}
+
+void I2cDevice::WriteMulti(unsigned char reg, unsigned char *pBuffer, int count)
+{
+    this->Transact([reg, pBuffer, count](I2CDEV *pDev)
+                   { writeMultiDev(pDev, reg, pBuffer, count); return 0; });
+}
+
+void I2cDevice::WriteRegList(unsigned char *pList)
+{
+    this->Transact([pList](I2CDEV *pDev)
+                   { writeRegListDev(pDev, pList); return 0; });
+}
@@ -1,20 +1,31 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
 #include <gpiod.h>
 #include "lasersensor.h"
+#include "i2cdevice.h"
 
 extern struct gpiod_chip *pChip;
+extern const char *pLaserCalibrationFile;
 #define default_address 0x29 // default address of a VL53L0X chip
 
-extern "C"
-{
-#include <tof.h> // time of flight sensor library
-}
-
 LaserSensor::LaserSensor()
 {
     this->i2cSlaveAddress = default_address;
+    this->calibrationAddress = default_address;
     this->pGpioLine = NULL;
+    this->gpioIntPin = -1;
+    this->pIntLine = NULL;
+    this->sampleDueTime = std::chrono::steady_clock::now();
+    this->pDevice = new I2cDevice(default_address);
+    tofGetPollConfig(&this->pollConfig);
+    this->is_continuous = false;
+    this->continuousPeriodMs = 0;
+    this->lastSample = {TOF_NOT_READY, 0, 0, 0, std::chrono::steady_clock::now()};
+    this->tof = {};
 }
 
 bool LaserSensor::ResetSensor(int gpioPin)
@@ -47,6 +58,50 @@ bool LaserSensor::ResetSensor(int gpioPin)
     return ret;
 }
 
+bool LaserSensor::IsConfigured(int slaveAddress)
+{ // the sensors keep their address as long as they are powered, e.g. when the program restarts
+    int model = -1;
+
+    if (this->pDevice->Open() || this->pDevice->SetAddress(slaveAddress))
+        return false;
+
+    this->pDevice->Transact([&model](I2CDEV *pDev)
+                            { return tofGetModelDev(pDev, &model, NULL); });
+
+    return model == 0xEE; // the model ID of the VL53L0X
+}
+
+bool LaserSensor::Reuse(int gpioPin, int slaveAddress)
+{
+    bool ret = false;
+
+    this->gpioRestPin = gpioPin;
+
+    // keep the sensor out of reset
+    if ((this->pGpioLine = gpiod_chip_get_line(::pChip, this->gpioRestPin)) == NULL)
+    {
+        printf("ERROR:%s(): gpiod_chip_get_line failed.\n", __func__);
+        ret = true;
+    }
+
+    if (!ret && gpiod_line_request_output(this->pGpioLine, "example1", 1) != 0)
+    {
+        printf("ERROR:%s(): gpiod_line_request_output failed.\n", __func__);
+        ret = true;
+    }
+
+    this->i2cSlaveAddress = slaveAddress;
+    this->calibrationAddress = slaveAddress;
+    if (!ret)
+        ret = this->pDevice->SetAddress(slaveAddress);
+
+    // it may still be ranging continuously from the last run
+    if (!ret)
+        this->pDevice->Transact(tofStopContinuousDev);
+
+    return ret;
+}
+
 // This method is not used, just for testing purposes
 bool LaserSensor::FinishResetting()
 {
@@ -73,12 +128,19 @@ bool LaserSensor::SetAddress(int newSlaveAddress)
     }
     usleep(10000);
 
+    this->calibrationAddress = newSlaveAddress; // the same sensor, it just isn't there yet
     this->i2cSlaveAddress = default_address;
+    if (!ret)
+        ret = this->pDevice->SetAddress(default_address);
     if (!ret)
         ret = this->Init();
 
     if (!ret)
-        setSensorAddress(1, newSlaveAddress);
+    {
+        this->pDevice->Transact([newSlaveAddress](I2CDEV *pDev)
+                                { tofSetAddressDev(pDev, newSlaveAddress); return 0; });
+        ret = this->pDevice->SetAddress(newSlaveAddress);
+    }
 
     this->i2cSlaveAddress = newSlaveAddress;
 
@@ -89,38 +151,521 @@ bool LaserSensor::Init()
 {
     bool ret = false;
     int model, revision;
+    bool wasContinuous = this->is_continuous;
+    TOFPROFILE profile = this->tof.profile;
+
+    if (this->pDevice->Open())
+        return true; // the error is already reported
+
+    if (wasContinuous)
+        this->StopContinuous(); // the calibration needs single ranging
+
+    { // e.g. the scheduler's rangings wait until the init is done
+        std::lock_guard<std::mutex> lock(this->rangingMutex);
+
+        if (!this->tof.cal_valid)
+            this->LoadCalibration(); // a full calibration is done if there is none or it doesn't match
 
-    // to set long range mode (up to 2m) last parameter should be 1
-    int i = tofInit(1, this->i2cSlaveAddress, 0); 
-    if (i != 1)
+        // to set long range mode (up to 2m) last parameter should be 1
+        if (this->TransactSteps([this](I2CDEV *pDev, int step)
+                                { return tofInitStepDev(pDev, &this->tof, 0, step); }))
+        {
+            printf("ERROR: %s(): tofInit() fails\n", __func__);
+            ret = true;
+        }
+        else
+        {
+            if (this->tof.cal_updated)
+                this->SaveCalibration(); // if it fails, the next start just calibrates again
+            usleep(10000); // sleep 10ms
+            // printf("VL53L0X device successfully opened.\n");
+            this->pDevice->Transact([&model, &revision](I2CDEV *pDev)
+                                    { return tofGetModelDev(pDev, &model, &revision); });
+            // printf("Model ID - %d\n", model);
+            // printf("Revision ID - %d\n", revision);
+        }
+
+        if (!ret && profile != this->tof.profile && this->TransactSteps([this, profile](I2CDEV *pDev, int step)
+                                                                        { return tofSetProfileStepDev(pDev, &this->tof, profile, step); }))
+        { // a re-init keeps the profile
+            printf("ERROR: %s(): tofSetProfileDev() fails\n", __func__);
+            ret = true;
+        }
+    }
+
+    if (!ret && wasContinuous)
+        ret = this->StartContinuous(this->continuousPeriodMs);
+
+    return ret;
+}
+
+bool LaserSensor::TransactSteps(const std::function<int(I2CDEV *, int)> &step)
+{ // each step is a short transaction of its own, the others use the bus between them and while the sensor works
+    int waits = 0;
+
+    for (int i = TOF_STEP_FIRST; i != TOF_STEP_DONE;)
     {
-        printf("ERROR: %s(): tofInit() fails\n", __func__);
+        int next = this->pDevice->Transact([&step, i](I2CDEV *pDev)
+                                           { return step(pDev, i); });
+        if (next == TOF_STEP_FAILED)
+            return true;
+        if (next == i)
+        { // the sensor is still working on it
+            if (++waits > TOF_STEP_MAX_WAITS)
+            {
+                printf("ERROR: %s(): step %d timed out\n", __func__, i);
+                return true;
+            }
+            usleep(TOF_STEP_WAIT_US);
+        }
+        else
+            waits = 0;
+        i = next;
+    }
+
+    return false;
+}
+
+int LaserSensor::GetDistanceCm()
+{
+    RangeSample sample = this->GetSample();
+
+    if (sample.distanceMm < 0)
+        return sample.distanceMm; // a timeout must not look like an obstacle at 0cm
+    if (!sample.IsValid())
+        return TOF_TIMEOUT; // e.g. no target, or the distance > 4096
+
+    int distanceInCm = sample.distanceMm / 10;
+
+    return distanceInCm;
+}
+
+RangeSample LaserSensor::GetSample()
+{
+    // one ranging at a time on this sensor, but the bus is only used for the
+    // short transactions, not while the sensor is measuring
+    std::lock_guard<std::mutex> lock(this->rangingMutex);
+    int iDistance;
+    TOFPOLL poll;
+
+    tofPollStart(&poll, &this->pollConfig, tofGetTimingBudget(&this->tof));
+    iDistance = this->StartRanging(&poll);
+    if (iDistance == TOF_NOT_READY && this->pIntLine != NULL)
+    { // no status polling, the sensor tells when the sample is there
+        std::chrono::microseconds due = std::chrono::duration_cast<std::chrono::microseconds>(this->sampleDueTime - std::chrono::steady_clock::now());
+        uint32_t waitUs = due.count() > 0 ? (uint32_t)due.count() : 0;
+        if (this->WaitSampleEvent(waitUs < tofPollRemaining(&poll) ? waitUs : tofPollRemaining(&poll)))
+        {
+            this->ReadSample(this->lastEventTime);
+            iDistance = this->lastSample.distanceMm;
+        }
+    }
+    // without an interrupt line, or if its edge didn't come in time
+    while (iDistance == TOF_NOT_READY && tofPollWait(&poll))
+        iDistance = this->CollectRanging();
+
+    if (iDistance == TOF_NOT_READY)
+        return {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()};
+
+    return this->lastSample;
+}
+
+bool LaserSensor::GetDistancesCm(LaserSensor *pSensors[], int count, int distances[])
+{
+    std::vector<RangeSample> samples(count > 0 ? count : 0);
+    bool ret = GetSamples(pSensors, count, samples.data());
+
+    for (int i = 0; i < count; i++)
+    { // a timeout must not look like an obstacle at 0cm
+        distances[i] = samples[i].distanceMm < 0 ? samples[i].distanceMm : samples[i].distanceMm / 10;
+    }
+
+    return ret;
+}
+
+bool LaserSensor::GetSamples(LaserSensor *pSensors[], int count, RangeSample samples[])
+{ // all sensors range at the same time, so this takes about one timing budget, not count of them
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<int> distances(count > 0 ? count : 0);
+    bool ret = false;
+    int pending = 0;
+    uint32_t budgetUs = 0;
+    TOFPOLL poll;
+
+    if (count <= 0)
+        return true;
+
+    // each of them has its own budget, the deadline is for the longest one
+    for (int i = 0; i < count; i++)
+    {
+        if (tofGetTimingBudget(&pSensors[i]->tof) > budgetUs)
+            budgetUs = tofGetTimingBudget(&pSensors[i]->tof);
+    }
+    // locked in the order of their addresses, the callers may list the same sensors in another order
+    std::vector<LaserSensor *> lockOrder(pSensors, pSensors + count);
+    std::sort(lockOrder.begin(), lockOrder.end());
+    for (LaserSensor *pSensor : lockOrder)
+        locks.emplace_back(pSensor->rangingMutex);
+
+    tofPollStart(&poll, &pSensors[0]->pollConfig, budgetUs);
+    for (int i = 0; i < count; i++)
+    {
+        if ((distances[i] = pSensors[i]->StartRanging(&poll)) == TOF_NOT_READY)
+            pending++;
+    }
+
+    // the results are collected in the order they are done
+    while (pending > 0 && tofPollWait(&poll))
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (distances[i] == TOF_NOT_READY && (distances[i] = pSensors[i]->CollectRanging()) != TOF_NOT_READY)
+                pending--;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (distances[i] == TOF_NOT_READY)
+        {
+            samples[i] = {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()};
+            ret = true;
+        }
+        else
+            samples[i] = pSensors[i]->lastSample;
+    }
+
+    return ret;
+}
+
+int LaserSensor::StartRanging(TOFPOLL *pPoll)
+{ // returns the distance in mm if there is one already, TOF_NOT_READY if it has to be collected
+    if (this->is_continuous)
+    { // the latest sample is good if it isn't older than a ranging could take
+        this->FetchLatestSample();
+        std::chrono::microseconds age = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->lastSample.time);
+        if (this->lastSample.distanceMm >= 0 && (uint64_t)age.count() <= pPoll->deadline_us - pPoll->start_us)
+            return this->lastSample.distanceMm;
+        return TOF_NOT_READY;
+    }
+
+    if (this->pIntLine != NULL)
+        this->WaitSampleEvent(0); // drops a stale edge
+    this->pDevice->Transact([this](I2CDEV *pDev)
+                            { return tofStartRangingDev(pDev, &this->tof); });
+    this->ExpectSample();
+
+    return TOF_NOT_READY;
+}
+
+int LaserSensor::CollectRanging()
+{ // doesn't wait, returns TOF_NOT_READY if the sample isn't there yet
+    return this->FetchLatestSample() ? this->lastSample.distanceMm : TOF_NOT_READY;
+}
+
+bool LaserSensor::StartContinuous(int periodMs)
+{ // the sensor keeps measuring (back-to-back if periodMs is 0), a read just fetches the latest result
+    std::lock_guard<std::mutex> lock(this->rangingMutex);
+    bool ret = false;
+
+    if (this->pIntLine != NULL)
+        this->WaitSampleEvent(0); // drops the edges of the single rangings
+
+    if (this->pDevice->Transact([this, periodMs](I2CDEV *pDev)
+                                { return tofStartContinuousDev(pDev, &this->tof, periodMs); }) != 1)
+    {
+        printf("ERROR: %s(): tofStartContinuousDev() fails\n", __func__);
         ret = true;
     }
     else
     {
-        usleep(10000); // sleep 10ms
-        // printf("VL53L0X device successfully opened.\n");
-        i = tofGetModel(&model, &revision);
-        // printf("Model ID - %d\n", model);
-        // printf("Revision ID - %d\n", revision);
+        this->is_continuous = true;
+        this->continuousPeriodMs = periodMs;
+        this->lastSample.distanceMm = TOF_NOT_READY;
+        this->ExpectSample();
     }
+
     return ret;
 }
 
-int LaserSensor::GetDistanceCm()
+bool LaserSensor::StopContinuous()
 {
-    switchSensor(this->i2cSlaveAddress);
-    usleep(1000); // sleep 1ms
-    int iDistance = tofReadDistance();
-    // if iDistance > 4096, then it is invalid
-    int distanceInCm = iDistance / 10;
+    std::lock_guard<std::mutex> lock(this->rangingMutex);
 
-    return distanceInCm;
+    this->pDevice->Transact(tofStopContinuousDev);
+    this->is_continuous = false;
+
+    return false;
+}
+
+bool LaserSensor::FetchLatestSample()
+{ // reads the sample if there is a new one, returns true if there was one
+    TOFSAMPLE sample;
+
+    if (this->pIntLine != NULL)
+    { // a pending edge means a new sample, the bus is used only to read it
+        if (this->WaitSampleEvent(0))
+        {
+            this->ReadSample(this->lastEventTime);
+            return true;
+        }
+        if (std::chrono::steady_clock::now() < this->sampleDueTime)
+            return false; // its edge may still come
+        // the sample is due but no edge came: the status register tells
+    }
+
+    // checking and reading are one transaction
+    int result = this->pDevice->Transact([&sample](I2CDEV *pDev)
+                                         { return tofRangeReadyDev(pDev) ? tofReadSampleDev(pDev, &sample) : TOF_NOT_READY; });
+    if (result == TOF_NOT_READY)
+        return false;
+
+    if (result < 0)
+        this->lastSample = {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()}; // the result couldn't be read
+    else
+        this->lastSample = {sample.range_mm, sample.range_status, sample.signal_rate / 128.0f, sample.ambient_rate / 128.0f,
+                            std::chrono::steady_clock::now()};
+    this->ExpectSample();
+
+    return true;
+}
+
+void LaserSensor::ReadSample(std::chrono::steady_clock::time_point time)
+{ // the rates are 9.7 fixed point numbers
+    TOFSAMPLE sample;
+
+    if (this->pDevice->Transact([&sample](I2CDEV *pDev)
+                                { return tofReadSampleDev(pDev, &sample); }) < 0)
+        this->lastSample = {TOF_TIMEOUT, 0, 0, 0, time}; // the result couldn't be read
+    else
+        this->lastSample = {sample.range_mm, sample.range_status, sample.signal_rate / 128.0f, sample.ambient_rate / 128.0f, time};
+    this->ExpectSample();
+}
+
+void LaserSensor::ExpectSample()
+{ // the next sample is due a bit later than a ranging (and the period between them) takes
+    uint32_t dueUs = tofGetTimingBudget(&this->tof) * 3 / 2 + (this->is_continuous ? this->continuousPeriodMs * 1000 : 0);
+
+    this->sampleDueTime = std::chrono::steady_clock::now() + std::chrono::microseconds(dueUs);
+}
+
+bool LaserSensor::SetInterruptPin(int gpioPin)
+{
+    bool ret = false;
+
+    this->gpioIntPin = gpioPin;
+
+    if ((this->pIntLine = gpiod_chip_get_line(::pChip, this->gpioIntPin)) == NULL)
+    {
+        printf("ERROR:%s(): gpiod_chip_get_line failed.\n", __func__);
+        ret = true;
+    }
+
+    // initSensor() sets GPIO1 active low on a new sample
+    if (!ret && gpiod_line_request_falling_edge_events(this->pIntLine, "lasersensor") != 0)
+    {
+        printf("ERROR:%s(): gpiod_line_request_falling_edge_events failed.\n", __func__);
+        ret = true;
+    }
+
+    // a pin with nothing on it gives no error, only no edges
+    if (!ret && !this->IsInterruptWorking())
+    {
+        printf("ERROR:%s(): no edge came on GPIO%d, it is not wired to the sensor's GPIO1\n", __func__, this->gpioIntPin);
+        gpiod_line_release(this->pIntLine);
+        ret = true;
+    }
+
+    if (ret)
+        this->pIntLine = NULL; // back to polling the status register
+
+    return ret;
+}
+
+bool LaserSensor::IsInterruptWorking()
+{ // one ranging, its sample has to come with an edge
+    std::lock_guard<std::mutex> lock(this->rangingMutex);
+    TOFPOLL poll;
+    bool gotEdge;
+
+    this->WaitSampleEvent(0); // drops a stale edge
+    tofPollStart(&poll, &this->pollConfig, tofGetTimingBudget(&this->tof));
+    this->pDevice->Transact([this](I2CDEV *pDev)
+                            { return tofStartRangingDev(pDev, &this->tof); });
+    gotEdge = this->WaitSampleEvent(tofPollRemaining(&poll));
+
+    // the sample is read anyway, that clears the sensor's interrupt
+    while (this->pDevice->Transact(tofRangeReadyDev) != 1 && tofPollWait(&poll))
+        ;
+    this->ReadSample(std::chrono::steady_clock::now());
+
+    return gotEdge;
+}
+
+bool LaserSensor::WaitSampleEvent(uint32_t timeoutUs)
+{ // waits for the edge of a new sample, its time is the kernel's timestamp of the edge
+    struct timespec timeout = {(time_t)(timeoutUs / 1000000), (long)(timeoutUs % 1000000) * 1000};
+    struct gpiod_line_event event;
+    bool gotEvent = false;
+
+    while (gpiod_line_event_wait(this->pIntLine, &timeout) == 1)
+    {
+        if (gpiod_line_event_read(this->pIntLine, &event) != 0)
+        {
+            printf("ERROR:%s(): gpiod_line_event_read failed.\n", __func__);
+            break;
+        }
+        // the edge is stamped with CLOCK_MONOTONIC, which is steady_clock's
+        this->lastEventTime = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(event.ts.tv_sec) + std::chrono::nanoseconds(event.ts.tv_nsec)));
+        gotEvent = true;
+        timeout = {0, 0}; // take the queued edges too, only the latest one counts
+    }
+
+    return gotEvent;
+}
+
+int LaserSensor::GetLatestDistanceCm(int *pAgeMs)
+{ // in continuous mode: the latest result without any waiting, and its age
+    RangeSample sample = this->GetLatestSample();
+
+    if (sample.distanceMm < 0)
+        return sample.distanceMm; // no sample yet
+
+    if (pAgeMs != NULL)
+        *pAgeMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - sample.time).count();
+
+    return sample.distanceMm / 10;
+}
+
+RangeSample LaserSensor::GetLatestSample()
+{
+    std::lock_guard<std::mutex> lock(this->rangingMutex);
+
+    if (this->is_continuous)
+        this->FetchLatestSample();
+
+    return this->lastSample;
+}
+
+uint32_t LaserSensor::GetTimingBudgetUs()
+{
+    return tofGetTimingBudget(&this->tof);
+}
+
+bool LaserSensor::SetProfile(TOFPROFILE profile)
+{
+    bool ret = false;
+    bool wasContinuous = this->is_continuous;
+
+    if (wasContinuous)
+        this->StopContinuous(); // the VCSEL periods can't be changed while ranging
+
+    {
+        std::lock_guard<std::mutex> lock(this->rangingMutex);
+        // the phase calibration after a VCSEL change is waited for between the transactions
+        if (this->TransactSteps([this, profile](I2CDEV *pDev, int step)
+                                { return tofSetProfileStepDev(pDev, &this->tof, profile, step); }))
+        {
+            printf("ERROR: %s(): tofSetProfileDev() fails\n", __func__);
+            ret = true;
+        }
+    }
+
+    if (wasContinuous && this->StartContinuous(this->continuousPeriodMs))
+        ret = true;
+
+    return ret;
+}
+
+// the cache file has one line per sensor address:
+// address, SPAD count, aperture type, the SPAD map after reset, the SPAD map in use,
+// VHV settings, phase calibration, long range mode; all in hex
+bool LaserSensor::LoadCalibration()
+{
+    FILE *fp;
+    char line[128];
+    unsigned int v[18];
+
+    if ((fp = fopen(pLaserCalibrationFile, "r")) == NULL)
+        return true; // no cache yet
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "%x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x",
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8],
+                   &v[9], &v[10], &v[11], &v[12], &v[13], &v[14], &v[15], &v[16], &v[17]) != 18 ||
+            (int)v[0] != this->calibrationAddress)
+            continue;
+
+        this->tof.cal.spad_count = v[1];
+        this->tof.cal.spad_type_is_aperture = v[2];
+        for (int i = 0; i < 6; i++)
+        {
+            this->tof.cal.nvm_spad_map[i] = v[3 + i];
+            this->tof.cal.ref_spad_map[i] = v[9 + i];
+        }
+        this->tof.cal.vhv_settings = v[15];
+        this->tof.cal.phase_cal = v[16];
+        this->tof.cal.long_range = v[17];
+        this->tof.cal_valid = true;
+    }
+    fclose(fp);
+
+    return !this->tof.cal_valid;
+}
+
+bool LaserSensor::SaveCalibration()
+{
+    std::vector<std::string> lines;
+    FILE *fp;
+    char line[128];
+    unsigned int address;
+    const TOFCAL &cal = this->tof.cal;
+
+    // keep the other sensors' lines
+    if ((fp = fopen(pLaserCalibrationFile, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            if (sscanf(line, "%x", &address) == 1 && (int)address != this->calibrationAddress)
+                lines.push_back(line);
+        }
+        fclose(fp);
+    }
+
+    if ((fp = fopen(pLaserCalibrationFile, "w")) == NULL)
+    {
+        printf("ERROR:%s(): can't write %s\n", __func__, pLaserCalibrationFile);
+        return true;
+    }
+    for (const std::string &s : lines)
+        fputs(s.c_str(), fp);
+    fprintf(fp, "%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+            this->calibrationAddress, cal.spad_count, cal.spad_type_is_aperture,
+            cal.nvm_spad_map[0], cal.nvm_spad_map[1], cal.nvm_spad_map[2], cal.nvm_spad_map[3], cal.nvm_spad_map[4], cal.nvm_spad_map[5],
+            cal.ref_spad_map[0], cal.ref_spad_map[1], cal.ref_spad_map[2], cal.ref_spad_map[3], cal.ref_spad_map[4], cal.ref_spad_map[5],
+            cal.vhv_settings, cal.phase_cal, cal.long_range);
+    fclose(fp);
+
+    return false;
+}
+
+void LaserSensor::SetPolling(const TOFPOLLCFG &config)
+{ // how to wait for the result of a ranging, see TOFPOLLCFG in tof.h
+    this->pollConfig = config;
+}
+
+void LaserSensor::SetArbiter(I2cArbiter *pArbiter, I2cPriority priority)
+{ // the bus transactions of this sensor go through the arbiter with the given priority
+    this->pDevice->SetArbiter(pArbiter, priority);
 }
 
 void LaserSensor::Finish()
 {
+    if (this->is_continuous)
+        this->StopContinuous();
     if (this->pGpioLine != NULL)
         gpiod_line_release(this->pGpioLine);
+    if (this->pIntLine != NULL)
+        gpiod_line_release(this->pIntLine);
 }
\ No newline at end of file
@@ -4,11 +4,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "lsm6dsox_lis3mdl.h"
-
-extern "C"
-{
-#include <tof.h> // time of flight sensor library
-}
+#include "i2cdevice.h"
 
 #define LSM6DSOX_SLAVE 0x6A 
 #define LSM6DSOX_SSTATUS 0x1E // 1: accel available, 2: gyro available, 4: temp available
@@ -16,6 +12,21 @@ extern "C"
 #define LSM6DSOX_CTRL1_XL 0x10 //0b01010000 (0x50)// 0x50=208Hz accelerometer normal mode, 3.33Khz: 0x90, +-2G
 #define LSM6DSOX_CTRL2_G 0x11 //:0b01010010 (0x52)// 0x52=208Hz high performance mode, 3.33Khz: 0x92, +-125dps
 #define LSM6DSOX_CTRL3_C 0x12 //:0b00000100 (0x04) // Register address automatically incremented during a multiple byte access with a serial interface
+#define LSM6DSOX_CTRL10_C 0x19 // 0x20: timestamp counter enabled
+
+// FIFO
+#define LSM6DSOX_FIFO_CTRL1 0x07 // watermark, not used
+#define LSM6DSOX_FIFO_CTRL2 0x08
+#define LSM6DSOX_FIFO_CTRL3 0x09 // batch data rates: gyro in the high 4 bits, accel in the low 4 bits
+#define LSM6DSOX_FIFO_CTRL4 0x0A // 0x40: a timestamp in every batch, 0x06: continuous mode, 0x00: bypass
+#define LSM6DSOX_FIFO_STATUS1 0x3A // the number of unread words, low 8 bits
+#define LSM6DSOX_FIFO_STATUS2 0x3B // 0x03: the high 2 bits of it, 0x40: overrun
+#define LSM6DSOX_FIFO_DATA_OUT_TAG 0x78 // a tag byte and 6 data bytes per word, a burst read rolls over to the next word
+#define FIFO_WORD_SIZE 7
+#define FIFO_WORDS_PER_READ 32 // a transaction must be short, the rest is read in the next one
+#define FIFO_TAG_GYRO 0x01
+#define FIFO_TAG_ACCEL 0x02
+#define FIFO_TAG_TIMESTAMP 0x04
 
 #define EARTH_GRAVITY 9.81
 #define ACCEL_SCALING_FOR_2G 0.06104 // sensitivy per LSM6DSOX data sheet in mm/s2
@@ -59,35 +70,46 @@ extern "C"
 
 extern bool debug;
 
+Lsm6dsoxLis3mdl::Lsm6dsoxLis3mdl()
+{
+    this->pLsm6dsox = new I2cDevice(LSM6DSOX_SLAVE);
+    this->pLis3mdl = new I2cDevice(LIS3MDL_SLAVE);
+    this->accelRawBias = {0, 0, 0};
+    this->gyroRawBias = {0, 0, 0};
+    this->lastGyroRawValues = {0, 0, 0};
+    this->lastAccelRawValues = {0, 0, 0};
+    this->fifoOverrunReported = false;
+}
+
 bool Lsm6dsoxLis3mdl::Init()
 {
-    bool ret = ::initI2C(1);
+    bool ret = false;
 
     if(!ret)
     { // init LSM6DSOX
-        ret = switchSensor(LSM6DSOX_SLAVE);
+        ret = this->pLsm6dsox->Open();
         if(!ret)
         {
-            ::writeReg(LSM6DSOX_CTRL1_XL, 0x90); // 0x50=208Hz, 0x90=3.3Khz
-            ::writeReg(LSM6DSOX_CTRL2_G, 0x92); // 0x52=208Hz, 0x92=3.3Khz
-            ::writeReg(LSM6DSOX_CTRL3_C, 0x04);
+            this->pLsm6dsox->WriteReg(LSM6DSOX_CTRL1_XL, 0x90); // 0x50=208Hz, 0x90=3.3Khz
+            this->pLsm6dsox->WriteReg(LSM6DSOX_CTRL2_G, 0x92); // 0x52=208Hz, 0x92=3.3Khz
+            this->pLsm6dsox->WriteReg(LSM6DSOX_CTRL3_C, 0x04);
 
-            unsigned char id = ::readReg(WHO_AM_I);
+            unsigned char id = this->pLsm6dsox->ReadReg(WHO_AM_I);
             if(::debug) printf("LSM6DSOX says its id is 0%x (should be 0x6c)\n", id);
         }
     }
 
     if(!ret)
     { // init LIS3MDL
-        ret = ::switchSensor(LIS3MDL_SLAVE);
+        ret = this->pLis3mdl->Open();
         if(!ret)
         {
-            ::writeReg(LIS3MDL_CTRL_REG2, 0x0C); // reset and reboot memory content, and set range for +-4G
+            this->pLis3mdl->WriteReg(LIS3MDL_CTRL_REG2, 0x0C); // reset and reboot memory content, and set range for +-4G
             usleep(1000);
-            ::writeReg(LIS3MDL_CTRL_REG1, 0xDC);
-            ::writeReg(LIS3MDL_CTRL_REG3, 0x00);
+            this->pLis3mdl->WriteReg(LIS3MDL_CTRL_REG1, 0xDC);
+            this->pLis3mdl->WriteReg(LIS3MDL_CTRL_REG3, 0x00);
 
-            unsigned char id = ::readReg(WHO_AM_I);
+            unsigned char id = this->pLis3mdl->ReadReg(WHO_AM_I);
             if(::debug) printf("LIS3MDL says its id is 0%x (should be 0x3d)\n", id);
         }
     }
@@ -95,42 +117,190 @@ bool Lsm6dsoxLis3mdl::Init()
     return ret;
 }
 
-Lsm6dsoxLis3mdl::vector<int> Lsm6dsoxLis3mdl::GetAcceleratorRawValues()
+unsigned char Lsm6dsoxLis3mdl::ReadStatusAndValues(I2cDevice *pDevice, unsigned char statusReg, unsigned char readyMask,
+                                                   unsigned char valuesReg, unsigned char buffer[6])
+{ // reads the status, and if the values are ready, the values too in the same bus transaction
+    return (unsigned char)pDevice->Transact([=](I2CDEV *pDev)
+    {
+        unsigned char status = readRegDev(pDev, statusReg);
+        if(status & readyMask)
+            readMultiDev(pDev, valuesReg, buffer, 6);
+        return (int)status;
+    });
+}
+
+unsigned char Lsm6dsoxLis3mdl::ReadRawValues(vector<int> &accel, vector<int> &gyro, vector<int> &compass)
+{ // updates the values that are ready, returns which ones: 1: accel, 2: gyro, 4: compass
+  // (quiet, no printing, it is called all the time by the sensor sampler)
+    unsigned char fresh = 0;
+    unsigned char buffer[12];
+
+    // gyro and accel outputs are next to each other, so they are one read
+    unsigned char status = (unsigned char)this->pLsm6dsox->Transact([&buffer](I2CDEV *pDev)
+    {
+        unsigned char status = readRegDev(pDev, LSM6DSOX_SSTATUS);
+        if(status & 3)
+            readMultiDev(pDev, GYRO_X_OUT_LOW, buffer, 12);
+        return (int)status;
+    });
+    if(status & 2)
+    {
+        gyro.x = (int16_t)(buffer[1] << 8 | buffer[0]);
+        gyro.y = (int16_t)(buffer[3] << 8 | buffer[2]);
+        gyro.z = (int16_t)(buffer[5] << 8 | buffer[4]);
+        fresh |= 2;
+    }
+    if(status & 1)
+    {
+        accel.x = (int16_t)(buffer[7] << 8 | buffer[6]);
+        accel.y = (int16_t)(buffer[9] << 8 | buffer[8]);
+        accel.z = (int16_t)(buffer[11] << 8 | buffer[10]);
+        fresh |= 1;
+    }
+
+    status = this->ReadStatusAndValues(this->pLis3mdl, LIS3MDL_STATUS, 8, COMPASS_X_OUT_LOW, buffer);
+    if(status & 8)
+    {
+        compass.x = (int16_t)(buffer[1] << 8 | buffer[0]);
+        compass.y = (int16_t)(buffer[3] << 8 | buffer[2]);
+        compass.z = (int16_t)(buffer[5] << 8 | buffer[4]);
+        fresh |= 4;
+    }
+
+    return fresh;
+}
+
+bool Lsm6dsoxLis3mdl::StartFifo(int batchRateHz)
+{ // returns false if success, true otherwise
+    // the batch data rates the chip has, the code of the first one is 1
+    const int rates[] = {12, 26, 52, 104, 208, 417, 833, 1667, 3333, 6667};
+    int code = 1;
+
+    for(int i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])); i++)
+    {
+        if(rates[i] <= batchRateHz)
+            code = i + 1;
+    }
+
+    this->fifoSample = {0, {0, 0, 0}, {0, 0, 0}, 0};
+    this->fifoOverrunReported = false;
+    return this->pLsm6dsox->Transact([code](I2CDEV *pDev)
+    {
+        writeRegDev(pDev, LSM6DSOX_FIFO_CTRL4, 0x00); // bypass mode empties the FIFO
+        writeRegDev(pDev, LSM6DSOX_CTRL10_C, 0x20);
+        writeRegDev(pDev, LSM6DSOX_FIFO_CTRL1, 0x00);
+        writeRegDev(pDev, LSM6DSOX_FIFO_CTRL2, 0x00);
+        writeRegDev(pDev, LSM6DSOX_FIFO_CTRL3, (unsigned char)(code << 4 | code));
+        writeRegDev(pDev, LSM6DSOX_FIFO_CTRL4, 0x46); // a timestamp every batch, continuous mode
+        return 0;
+    }) != 0;
+}
+
+void Lsm6dsoxLis3mdl::StopFifo()
 {
-    vector<int> accel = {0, 0, 0};
+    this->pLsm6dsox->WriteReg(LSM6DSOX_FIFO_CTRL4, 0x00);
+}
 
-    if(!::switchSensor(LSM6DSOX_SLAVE))
+int Lsm6dsoxLis3mdl::ReadFifo(std::vector<FifoSample> &samples)
+{ // a timestamp word starts a batch, the gyro and accel words after it belong to that time
+    unsigned char status[2] = {0, 0};
+    unsigned char buffer[FIFO_WORDS_PER_READ * FIFO_WORD_SIZE];
+    int total = 0;
+
+    if(this->pLsm6dsox->ReadMulti(LSM6DSOX_FIFO_STATUS1, status, 2))
+        return 0; // nothing is decoded from a failed read
+    int words = (status[1] & 0x03) << 8 | status[0];
+    // reported once, not at every read while it lasts
+    if((status[1] & 0x40) && !this->fifoOverrunReported)
+        printf("ERROR:%s(): the FIFO overran, it has to be read more often\n", __func__);
+    this->fifoOverrunReported = (status[1] & 0x40) != 0;
+
+    while(words > 0)
     {
-        unsigned char status = ::readReg(LSM6DSOX_SSTATUS);
-        if(::debug)
+        int count = words < FIFO_WORDS_PER_READ ? words : FIFO_WORDS_PER_READ;
+        if(this->pLsm6dsox->ReadMulti(LSM6DSOX_FIFO_DATA_OUT_TAG, buffer, count * FIFO_WORD_SIZE))
+            break;
+
+        for(int i = 0; i < count; i++)
         {
-            printf("Status: %s,%s,%s\n", 
-                ((status & 1) ? "accel is avail" : ""),
-                ((status & 2) ? "gyro is avail" : ""),
-                ((status & 4) ? "temp is avail" : ""));    
+            unsigned char *pWord = &buffer[i * FIFO_WORD_SIZE];
+            unsigned char *pData = pWord + 1;
+            switch(pWord[0] >> 3)
+            {
+            case FIFO_TAG_TIMESTAMP:
+                if(this->fifoSample.fresh != 0)
+                    samples.push_back(this->fifoSample);
+                this->fifoSample.timestamp = (uint32_t)pData[3] << 24 | (uint32_t)pData[2] << 16 | (uint32_t)pData[1] << 8 | pData[0];
+                this->fifoSample.fresh = 0;
+                break;
+            case FIFO_TAG_GYRO:
+                this->fifoSample.gyro.x = (int16_t)(pData[1] << 8 | pData[0]);
+                this->fifoSample.gyro.y = (int16_t)(pData[3] << 8 | pData[2]);
+                this->fifoSample.gyro.z = (int16_t)(pData[5] << 8 | pData[4]);
+                this->fifoSample.fresh |= 2;
+                break;
+            case FIFO_TAG_ACCEL:
+                this->fifoSample.accel.x = (int16_t)(pData[1] << 8 | pData[0]);
+                this->fifoSample.accel.y = (int16_t)(pData[3] << 8 | pData[2]);
+                this->fifoSample.accel.z = (int16_t)(pData[5] << 8 | pData[4]);
+                this->fifoSample.fresh |= 1;
+                break;
+            default: // temperature and the others are not batched
+                break;
+            }
         }
+        words -= count;
+        total += count;
+    }
 
-        if(status & 1)
-        {
-            unsigned char buffer[6];
-            ::readMulti(ACCEL_X_OUT_LOW, buffer, 6);
-            accel.x = (int16_t)(buffer[1] << 8 | buffer[0]);
-            accel.y = (int16_t)(buffer[3] << 8 | buffer[2]);
-            accel.z = (int16_t)(buffer[5] << 8 | buffer[4]);
+    // the last batch is complete once both of its values are there
+    if(this->fifoSample.fresh == 3)
+    {
+        samples.push_back(this->fifoSample);
+        this->fifoSample.fresh = 0;
+    }
 
-            lastAccelRawValues.x = accel.x;
-            lastAccelRawValues.y = accel.y;
-            lastAccelRawValues.z = accel.z;
+    return total;
+}
 
-            if(::debug) printf("Accel: x:%d y:%d z:%d\n", accel.x, accel.y, accel.z);
-        }
-        else
-        {
-            accel.x = lastAccelRawValues.x;
-            accel.y = lastAccelRawValues.y;
-            accel.z = lastAccelRawValues.z;
-            printf("ERROR: can't read accelerator values - they are not ready.\n");
-        }
+void Lsm6dsoxLis3mdl::SetArbiter(I2cArbiter *pArbiter)
+{ // the bus transactions of both chips go through the arbiter
+    this->pLsm6dsox->SetArbiter(pArbiter, I2cPriority::IMU);
+    this->pLis3mdl->SetArbiter(pArbiter, I2cPriority::IMU);
+}
+
+Lsm6dsoxLis3mdl::vector<int> Lsm6dsoxLis3mdl::GetAcceleratorRawValues()
+{
+    vector<int> accel = {0, 0, 0};
+
+    unsigned char buffer[6];
+    unsigned char status = this->ReadStatusAndValues(this->pLsm6dsox, LSM6DSOX_SSTATUS, 1, ACCEL_X_OUT_LOW, buffer);
+    if(::debug)
+    {
+        printf("Status: %s,%s,%s\n", 
+            ((status & 1) ? "accel is avail" : ""),
+            ((status & 2) ? "gyro is avail" : ""),
+            ((status & 4) ? "temp is avail" : ""));    
+    }
+
+    if(status & 1)
+    {
+        accel.x = (int16_t)(buffer[1] << 8 | buffer[0]);
+        accel.y = (int16_t)(buffer[3] << 8 | buffer[2]);
+        accel.z = (int16_t)(buffer[5] << 8 | buffer[4]);
+
+        lastAccelRawValues.x = accel.x;
+        lastAccelRawValues.y = accel.y;
+        lastAccelRawValues.z = accel.z;
+
+        if(::debug) printf("Accel: x:%d y:%d z:%d\n", accel.x, accel.y, accel.z);
+    }
+    else
+    {
+        accel.x = lastAccelRawValues.x;
+        accel.y = lastAccelRawValues.y;
+        accel.z = lastAccelRawValues.z;
+        printf("ERROR: can't read accelerator values - they are not ready.\n");
     }
 
     return accel;
@@ -203,38 +373,34 @@ Lsm6dsoxLis3mdl::vector<int> Lsm6dsoxLis3mdl::GetGyroRawValues()
 {
     vector<int> gyro =  {0, 0, 0};
 
-     if(!::switchSensor(LSM6DSOX_SLAVE))
+    unsigned char buffer[6];
+    unsigned char status = this->ReadStatusAndValues(this->pLsm6dsox, LSM6DSOX_SSTATUS, 2, GYRO_X_OUT_LOW, buffer);
+    if(::debug)
     {
-        unsigned char status = ::readReg(LSM6DSOX_SSTATUS);
-        if(::debug)
-        {
-            printf("Status: %s,%s,%s\n", 
-                ((status & 1) ? "accel is avail" : ""),
-                ((status & 2) ? "gyro is avail" : ""),
-                ((status & 4) ? "temp is avail" : ""));  
-        }  
+        printf("Status: %s,%s,%s\n", 
+            ((status & 1) ? "accel is avail" : ""),
+            ((status & 2) ? "gyro is avail" : ""),
+            ((status & 4) ? "temp is avail" : ""));  
+    }  
 
-        if(status & 2)
-        {
-            unsigned char buffer[6];
-            ::readMulti(GYRO_X_OUT_LOW, buffer, 6);
-            gyro.x = (int16_t)(buffer[1] << 8 | buffer[0]);
-            gyro.y = (int16_t)(buffer[3] << 8 | buffer[2]);
-            gyro.z = (int16_t)(buffer[5] << 8 | buffer[4]);
+    if(status & 2)
+    {
+        gyro.x = (int16_t)(buffer[1] << 8 | buffer[0]);
+        gyro.y = (int16_t)(buffer[3] << 8 | buffer[2]);
+        gyro.z = (int16_t)(buffer[5] << 8 | buffer[4]);
 
-            lastGyroRawValues.x = gyro.x;
-            lastGyroRawValues.y = gyro.y;
-            lastGyroRawValues.z = gyro.z;
+        lastGyroRawValues.x = gyro.x;
+        lastGyroRawValues.y = gyro.y;
+        lastGyroRawValues.z = gyro.z;
 
-            if(::debug) printf("Gyro raw w/o bias: x:%d y:%d z:%d\n", gyro.x, gyro.y, gyro.z);
-        }
-        else
-        {
-            gyro.x = lastGyroRawValues.x;
-            gyro.y = lastGyroRawValues.y;
-            gyro.z = lastGyroRawValues.z;
-            printf("ERROR: can't read gyro values - they are not ready.\n");
-        }
+        if(::debug) printf("Gyro raw w/o bias: x:%d y:%d z:%d\n", gyro.x, gyro.y, gyro.z);
+    }
+    else
+    {
+        gyro.x = lastGyroRawValues.x;
+        gyro.y = lastGyroRawValues.y;
+        gyro.z = lastGyroRawValues.z;
+        printf("ERROR: can't read gyro values - they are not ready.\n");
     }
 
     return gyro;
@@ -267,6 +433,11 @@ Lsm6dsoxLis3mdl::vector<double> Lsm6dsoxLis3mdl::GetGyroValues()
 { // get gyro values, correct them with average bias, and scale them
     vector<int> gyroValues =  this->GetGyroRawValues();
 
+    return this->GyroRawToDps(gyroValues);
+}
+
+Lsm6dsoxLis3mdl::vector<double> Lsm6dsoxLis3mdl::GyroRawToDps(vector<int> gyroValues)
+{
     gyroValues.x -=  this->gyroRawBias.x;
     gyroValues.y -=  this->gyroRawBias.y;
     gyroValues.z -=  this->gyroRawBias.z;
@@ -304,29 +475,25 @@ Lsm6dsoxLis3mdl::vector<int> Lsm6dsoxLis3mdl::GetCompassRawValues()
 {
     vector<int> compass = {0, 0, 0};
 
-    if(!::switchSensor(LIS3MDL_SLAVE))
+    unsigned char buffer[6];
+    unsigned char status = this->ReadStatusAndValues(this->pLis3mdl, LIS3MDL_STATUS, 8, COMPASS_X_OUT_LOW, buffer);
+    if(::debug)
     {
-        unsigned char status = ::readReg(LIS3MDL_STATUS);
-        if(::debug)
-        {
-            printf("Status: %s,%s,%s,%s\n", 
-                ((status & 1) ? "x is avail" : ""),
-                ((status & 2) ? "y is avail" : ""),
-                ((status & 4) ? "z is avail" : ""),
-                ((status & 8) ? "xyz is avail" : ""));    
-        }
+        printf("Status: %s,%s,%s,%s\n", 
+            ((status & 1) ? "x is avail" : ""),
+            ((status & 2) ? "y is avail" : ""),
+            ((status & 4) ? "z is avail" : ""),
+            ((status & 8) ? "xyz is avail" : ""));    
+    }
 
-        if(status & 8) {
-            unsigned char buffer[6];
-            ::readMulti(COMPASS_X_OUT_LOW, buffer, 6);
-            compass.x = (int16_t)(buffer[1] << 8 | buffer[0]);
-            compass.y = (int16_t)(buffer[3] << 8 | buffer[2]);
-            compass.z = (int16_t)(buffer[5] << 8 | buffer[4]);
-        }
-        else
-        {
-            printf("ERROR: can't read compass - data is not ready\n");
-        }
+    if(status & 8) {
+        compass.x = (int16_t)(buffer[1] << 8 | buffer[0]);
+        compass.y = (int16_t)(buffer[3] << 8 | buffer[2]);
+        compass.z = (int16_t)(buffer[5] << 8 | buffer[4]);
+    }
+    else
+    {
+        printf("ERROR: can't read compass - data is not ready\n");
     }
 
     return compass;
@@ -20,6 +20,12 @@
 #include "pwm.h"
 #include "lsm6dsox_lis3mdl.h"
 #include "testing.h"
+#include "i2carbiter.h"
+#include "sensorsampler.h"
+#include "rangingscheduler.h"
+#include "polarscanner.h"
+#include "pca9685shadow.h"
+#include "headingestimator.h"
 
 using namespace std;
 
@@ -38,11 +44,31 @@ const char *myGoogleProjectId = "sprecforcar"; // my google project id
 
 const int servoControlPin = 15; // the pin on the PCA9685 board to control the S90 servo
 
+// GPIO pin budget:
+// GPIO2, GPIO3: I2C (PCA9685, laser sensors, IMU)
+// GPIO12, GPIO13, GPIO18, GPIO19: hardware PWM, see pwm-pi5-overlay.dts
+// GPIO17, GPIO27, GPIO22, GPIO23: laser sensors' reset (XSHUT)
+// GPIO5, GPIO6, GPIO24, GPIO25: laser sensors' GPIO1, with laserSensorsOnInterrupts
+// free: GPIO16, GPIO20, GPIO21, GPIO26
+
 // GPIO pins for the VL53L0X laser sensors reset feature
 const int rightSensorResetGpio = 17;
 const int leftSensorResetGpio = 27;
 const int forwardSensorResetGpio = 22;
 const int floorSensorResetGpio = 23;
+// GPIO1 (new sample ready) of the laser sensors; if it is not wired, the status register is polled over the bus
+const bool laserSensorsOnInterrupts = false;
+const int rightSensorIntGpio = 5;
+const int leftSensorIntGpio = 6;
+const int forwardSensorIntGpio = 24;
+const int floorSensorIntGpio = 25;
+
+// the TT motors' speed pins can be driven by the Raspberry's PWM at a motor friendly frequency
+// (see pwm-pi5-overlay.dts), the left ones from GPIO12, the right ones from GPIO18
+const bool motorsOnHardwarePwm = false;
+const int leftMotorPwmChannel = 0;  // GPIO12
+const int rightMotorPwmChannel = 2; // GPIO18
+const unsigned int motorPwmPeriodNs = 50000; // 20kHz
 
 // I2C addresses for the VL53L0X laser sensors
 const int rightSensorAddress = 0x31;
@@ -51,7 +77,9 @@ const int forwardSensorAddress = 0x33;
 const int floorSensorAddress = 0x34;
 
 struct gpiod_chip *pChip;
+const char *pLaserCalibrationFile = "laser_calibration.txt"; // SPAD and reference calibration of the laser sensors
 PiPCA9685::PCA9685 *pPCA;
+Pca9685Shadow *pPcaOutputs = NULL; // all the channel writes of the PCA9685 go through this
 
 // global pointers
 Testing *pTesting = NULL;
@@ -65,6 +93,11 @@ TextToSpeech *pTextToSpeech = NULL;
 SpeechToText *pSpeechToText = NULL;
 Lsm6dsoxLis3mdl *pLsmLis = NULL;
 PWM *pPwm = NULL;
+I2cArbiter *pI2cArbiter = NULL;
+SensorSampler *pSensorSampler = NULL;
+RangingScheduler *pRangingScheduler = NULL;
+PolarScanner *pPolarScanner = NULL;
+HeadingEstimator *pHeadingEstimator = NULL;
 
 bool stopProgram; // if this is set to true, the program execution loop stops
 
@@ -94,9 +127,17 @@ bool Init()
   }
 
   if (!ret)
+  { // from now on, the arbiter's thread does all the i2c transactions
+    pI2cArbiter = new I2cArbiter();
+    ret = pI2cArbiter->Start();
+  }
+
+  if (!ret && motorsOnHardwarePwm)
   {
     pPwm = new PWM();
-    ret = pPwm->Init();
+    ret = pPwm->SetupChannel(leftMotorPwmChannel, motorPwmPeriodNs);
+    if (!ret)
+      ret = pPwm->SetupChannel(rightMotorPwmChannel, motorPwmPeriodNs);
   }
 
   if (!ret)
@@ -105,7 +146,7 @@ bool Init()
     try
     {
       pPCA = new PiPCA9685::PCA9685();
-      pPCA->set_pwm_freq(50.0); 
+      pPCA->set_pwm_freq(PCA9685_FREQUENCY_HZ); 
       if (::debug)
         printf("PCA9685 is initialized.\n");
     }
@@ -115,6 +156,13 @@ bool Init()
     }
   }
 
+  if (!ret)
+  { // the library only sets the frequency, the channels are written in bursts from a shadow copy
+    pPcaOutputs = new Pca9685Shadow(0x40, PCA9685_FREQUENCY_HZ);
+    pPcaOutputs->SetArbiter(pI2cArbiter, I2cPriority::PWM);
+    ret = pPcaOutputs->Open();
+  }
+
   if (!ret)
   {
     pTextToSpeech = new TextToSpeech();
@@ -129,6 +177,7 @@ bool Init()
   if(!ret)
   {
     pLsmLis = new Lsm6dsoxLis3mdl();
+    pLsmLis->SetArbiter(pI2cArbiter);
     pLsmLis->Init();
   }
 
@@ -142,7 +191,8 @@ bool Init()
 // Initially each laser sensor has the same I2C slave address,
 // so we need to change this and set them to different addresses.
 // First, we put all of them in a reset state, then bring them out
-// of this state one-by-one and assign them a new I2C slave address
+// of this state one-by-one and assign them a new I2C slave address.
+// A restart finds them at their addresses already, those are not reset
 bool SetupLaserSensors()
 {
   bool ret = false;
@@ -152,36 +202,75 @@ bool SetupLaserSensors()
   pForwardSensor = new LaserSensor();
   pFloorSensor = new LaserSensor();
 
-  // put all of them in reset state
-  if (!ret)
-    ret = pRightSensor->ResetSensor(rightSensorResetGpio);
-  if (!ret)
-    ret = pLeftSensor->ResetSensor(leftSensorResetGpio);
-  if (!ret)
-    ret = pForwardSensor->ResetSensor(forwardSensorResetGpio);
-  if (!ret)
-    ret = pFloorSensor->ResetSensor(floorSensorResetGpio);
+  // the floor sensor tells if we are about to fall, so it goes first on the bus
+  pRightSensor->SetArbiter(pI2cArbiter, I2cPriority::RANGING);
+  pLeftSensor->SetArbiter(pI2cArbiter, I2cPriority::RANGING);
+  pForwardSensor->SetArbiter(pI2cArbiter, I2cPriority::RANGING);
+  pFloorSensor->SetArbiter(pI2cArbiter, I2cPriority::CLIFF);
+
+  LaserSensor *pSensors[] = {pRightSensor, pLeftSensor, pForwardSensor, pFloorSensor};
+  const int resetGpios[] = {rightSensorResetGpio, leftSensorResetGpio, forwardSensorResetGpio, floorSensorResetGpio};
+  const int addresses[] = {rightSensorAddress, leftSensorAddress, forwardSensorAddress, floorSensorAddress};
+  bool configured[4];
+
+  // the sensors stay powered between runs, the ones still answering
+  // at their address are taken over as they are, without a reset
+  for (int i = 0; i < 4; i++)
+  {
+    configured[i] = pSensors[i]->IsConfigured(addresses[i]);
+    if (::debug && configured[i])
+      printf("Laser sensor 0x%x is already set up\n", addresses[i]);
+  }
+
+  // put all the others in reset state
+  for (int i = 0; i < 4; i++)
+  {
+    if (!ret)
+      ret = configured[i] ? pSensors[i]->Reuse(resetGpios[i], addresses[i]) : pSensors[i]->ResetSensor(resetGpios[i]);
+  }
 
   // set address and initialize them one by one
-  if (!ret)
-    ret = pRightSensor->SetAddress(rightSensorAddress);
-  if (!ret)
-    ret = pRightSensor->Init();
+  for (int i = 0; i < 4; i++)
+  {
+    if (!ret && !configured[i])
+      ret = pSensors[i]->SetAddress(addresses[i]);
+    if (!ret)
+      ret = pSensors[i]->Init();
+  }
 
+  // if these fail (e.g. no edge comes), the status register is polled over the bus instead
+  if (!ret && laserSensorsOnInterrupts)
+  {
+    pRightSensor->SetInterruptPin(rightSensorIntGpio);
+    pLeftSensor->SetInterruptPin(leftSensorIntGpio);
+    pForwardSensor->SetInterruptPin(forwardSensorIntGpio);
+    pFloorSensor->SetInterruptPin(floorSensorIntGpio);
+  }
+
+  // fast sampling while cruising, the car switches to high accuracy when it looks for a new direction
   if (!ret)
-    ret = pLeftSensor->SetAddress(leftSensorAddress);
+    ret = pRightSensor->SetProfile(TOF_PROFILE_HIGH_SPEED);
   if (!ret)
-    ret = pLeftSensor->Init();
-
+    ret = pLeftSensor->SetProfile(TOF_PROFILE_HIGH_SPEED);
   if (!ret)
-    ret = pForwardSensor->SetAddress(forwardSensorAddress);
+    ret = pForwardSensor->SetProfile(TOF_PROFILE_HIGH_SPEED);
   if (!ret)
-    ret = pForwardSensor->Init();
+    ret = pFloorSensor->SetProfile(TOF_PROFILE_HIGH_SPEED);
 
+  // the floor sensor looks down, nothing else sees its light: it keeps measuring on its own
   if (!ret)
-    ret = pFloorSensor->SetAddress(floorSensorAddress);
+    ret = pFloorSensor->StartContinuous();
+
+  // the forward looking ones overlap, the scheduler keeps the neighbours from ranging at the same time
   if (!ret)
-    ret = pFloorSensor->Init();
+  {
+    LaserSensor *pScheduledSensors[] = {pLeftSensor, pForwardSensor, pRightSensor};
+    pRangingScheduler = new RangingScheduler(pScheduledSensors, 3);
+    pRangingScheduler->SetInterference(pLeftSensor, pForwardSensor);
+    pRangingScheduler->SetInterference(pForwardSensor, pRightSensor);
+    pRangingScheduler->BuildSlots();
+    ret = pRangingScheduler->Start();
+  }
 
   return ret;
 }
@@ -191,10 +280,47 @@ bool Setup()
 {
   bool ret = false;
 
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
   ret = SetupLaserSensors();
+  std::chrono::milliseconds duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+  printf("Laser sensors are set up in %lldms\n", (long long)duration.count());
 
   pServo = new Servo(servoControlPin);
-  pCar = new Car(pPCA, pLeftSensor, pRightSensor, pForwardSensor, pFloorSensor, pServo);
+  pCar = new Car(pPcaOutputs, pLeftSensor, pRightSensor, pForwardSensor, pFloorSensor, pServo);
+  if (motorsOnHardwarePwm)
+    pCar->SetHardwarePwm(pPwm, leftMotorPwmChannel, rightMotorPwmChannel);
+
+  // the car looks for a new direction with a sweep of the servo
+  pPolarScanner = new PolarScanner(pServo, pForwardSensor);
+  pPolarScanner->SetScheduler(pRangingScheduler);
+  pCar->SetScanner(pPolarScanner);
+  pCar->SetScheduler(pRangingScheduler);
+
+  // the car reads the sensors' latest values from here instead of waiting for the bus
+  if (!ret)
+  {
+    pSensorSampler = new SensorSampler(pForwardSensor, pLeftSensor, pRightSensor, pFloorSensor, pLsmLis);
+    // a single outlier must not stop the car: median of 3 everywhere, the forward ones are smoothed too
+    RangeFilterConfig floorFilter = {true, true, 0.0f, 3, 1.0f, 0.0f, 0.0f}; // no return from the floor is a cliff
+    RangeFilterConfig forwardFilter = {true, false, 0.0f, 3, 1.0f, 100.0f, 400.0f};
+    pSensorSampler->SetFilter(pFloorSensor, floorFilter);
+    pSensorSampler->SetFilter(pForwardSensor, forwardFilter);
+    pSensorSampler->SetFilter(pLeftSensor, forwardFilter);
+    pSensorSampler->SetFilter(pRightSensor, forwardFilter);
+    pSensorSampler->SetServo(pServo);
+    ret = pSensorSampler->Start();
+    pCar->SetSampler(pSensorSampler);
+  }
+
+  // the car stands still now: the gyro's bias is measured, then the heading is integrated all the time
+  if (!ret)
+  {
+    pHeadingEstimator = new HeadingEstimator(pLsmLis);
+    ret = pHeadingEstimator->Start();
+    if (!ret)
+      ret = pHeadingEstimator->CalibrateBias();
+    pCar->SetHeadingEstimator(pHeadingEstimator);
+  }
 
   pServo->Move(90); // set servo to the middle
   printf("Setup done.\nREADY!\n");
@@ -208,6 +334,16 @@ bool Finish()
   printf("Finish\n");
   if (pCar != NULL)
     pCar->Stop();
+  if (pSensorSampler != NULL)
+    pSensorSampler->Stop();
+  if (pHeadingEstimator != NULL)
+    pHeadingEstimator->Stop();
+  if (pRangingScheduler != NULL)
+  {
+    printf("Laser sampling rates: left %.1fHz, forward %.1fHz, right %.1fHz\n", pRangingScheduler->GetSampleRateHz(pLeftSensor),
+           pRangingScheduler->GetSampleRateHz(pForwardSensor), pRangingScheduler->GetSampleRateHz(pRightSensor));
+    pRangingScheduler->Stop();
+  }
   if (pServo != NULL)
     pServo->Move(90);
   // release all lines
@@ -220,6 +356,8 @@ bool Finish()
   if (pFloorSensor != NULL)
     pFloorSensor->Finish();
   gpiod_chip_close(pChip);
+  if (pI2cArbiter != NULL)
+    pI2cArbiter->Stop();
   sleep(1);
   return ret;
 }
@@ -343,10 +481,36 @@ int main(int argc, char **argv)
           case 'l':
             pTesting->TestLaserSensors();
             break;
+          case 'b':
+            pTesting->TestI2CThroughput(forwardSensorAddress, 2000);
+            pTesting->TestLaserSensorInitTime(pForwardSensor, 5);
+            break;
           case 'f':
             printf("Floor distance: %d\n", pFloorSensor->GetDistanceCm());
             printf("Is the road clear: %B\n", pCar->IsTheRoadClear());
             break;
+          case 'i':
+            printf("Laser sampling rates: left %.1fHz, forward %.1fHz, right %.1fHz\n", pRangingScheduler->GetSampleRateHz(pLeftSensor),
+                   pRangingScheduler->GetSampleRateHz(pForwardSensor), pRangingScheduler->GetSampleRateHz(pRightSensor));
+            // the scene in front of the car must not change during the test
+            pRangingScheduler->Stop();
+            if (pRangingScheduler->SelfTest())
+              printf("ERROR: laser interference self-test failed\n");
+            printf("Ranging slots: left %d, forward %d, right %d (%d slots)\n", pRangingScheduler->GetSlot(pLeftSensor),
+                   pRangingScheduler->GetSlot(pForwardSensor), pRangingScheduler->GetSlot(pRightSensor), pRangingScheduler->GetSlotCount());
+            pRangingScheduler->Start();
+            break;
+          case 'p':
+            if (!pPolarScanner->Scan())
+            {
+              for (int bin = 0; bin < pPolarScanner->GetBinCount(); bin++)
+                printf("%3d degrees: %dmm\n", pPolarScanner->GetBinAngle(bin), pPolarScanner->GetBinDistanceMm(bin));
+              printf("Best gap: %d degrees\n", pPolarScanner->FindBestGap(30, 20));
+            }
+            break;
+          case 'w':
+            pTesting->TestPwmChannel(10000);
+            break;
           case 'r':
             pTesting->TestServo();
             break;
@@ -370,7 +534,11 @@ int main(int argc, char **argv)
             printf("Usage: %s -c(ompass testing)\n", argv[0]);
             printf("Usage: %s -m<number:0-100>(otor testing with given speed percentage)\n", argv[0]);
             printf("Usage: %s -l(lasersensor testing)\n", argv[0]);
+            printf("Usage: %s -b(enchmark i2c register reads)\n", argv[0]);
             printf("Usage: %s -f(loor distance and road-clear testing)\n", argv[0]);
+            printf("Usage: %s -i(nterference self-test of the laser sensors, keep the scene still)\n", argv[0]);
+            printf("Usage: %s -p(olar scan with the servo and the forward laser sensor)\n", argv[0]);
+            printf("Usage: %s -w(PWM channel testing on a fake sysfs tree)\n", argv[0]);
             printf("Usage: %s -r(servo testing)\n", argv[0]);
             printf("Usage: %s -t(ext-to-speech testing)\n", argv[0]);
             printf("Usage: %s -s(peech-to-text testing)\n", argv[0]);
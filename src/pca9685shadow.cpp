@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include "pca9685shadow.h"
+
+// PCA9685 registers
+#define PCA9685_MODE1 0x00
+#define PCA9685_MODE1_AI 0x20 // register auto-increment
+#define PCA9685_LED0_ON_L 0x06
+
+Pca9685Shadow::Pca9685Shadow(int slaveAddress, float frequencyHz)
+{
+    this->pDevice = new I2cDevice(slaveAddress);
+    this->frequencyHz = frequencyHz;
+    memset(this->wanted, 0, sizeof(this->wanted));
+    memset(this->written, 0, sizeof(this->written));
+}
+
+Pca9685Shadow::~Pca9685Shadow()
+{
+    delete this->pDevice;
+}
+
+void Pca9685Shadow::SetArbiter(I2cArbiter *pArbiter, I2cPriority priority)
+{
+    this->pDevice->SetArbiter(pArbiter, priority);
+}
+
+bool Pca9685Shadow::Open()
+{ // returns false if success, true otherwise
+    std::lock_guard<std::mutex> lock(this->mutex);
+    bool ret = this->pDevice->Open();
+
+    if (!ret)
+    {
+        this->pDevice->Transact([this](I2CDEV *pDev)
+                                {
+            unsigned char mode1 = readRegDev(pDev, PCA9685_MODE1);
+            writeRegDev(pDev, PCA9685_MODE1, mode1 | PCA9685_MODE1_AI);
+            readMultiDev(pDev, PCA9685_LED0_ON_L, this->written, sizeof(this->written));
+            return 0; });
+        memcpy(this->wanted, this->written, sizeof(this->wanted));
+    }
+
+    return ret;
+}
+
+void Pca9685Shadow::SetPwm(int channel, int on, int off)
+{
+    if (channel < 0 || channel >= PCA9685_CHANNELS)
+    {
+        printf("ERROR:%s(): no channel %d\n", __func__, channel);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    unsigned char *pChannel = &this->wanted[channel * 4];
+    pChannel[0] = (unsigned char)(on & 0xff);
+    pChannel[1] = (unsigned char)((on >> 8) & 0x1f);
+    pChannel[2] = (unsigned char)(off & 0xff);
+    pChannel[3] = (unsigned char)((off >> 8) & 0x1f);
+}
+
+void Pca9685Shadow::SetChannels(int firstChannel, const unsigned char *pRegisters, int count)
+{ // 4 bytes per channel: ON_L, ON_H, OFF_L, OFF_H
+    if (firstChannel < 0 || count < 0 || firstChannel + count > PCA9685_CHANNELS)
+    {
+        printf("ERROR:%s(): no channels %d-%d\n", __func__, firstChannel, firstChannel + count - 1);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    memcpy(&this->wanted[firstChannel * 4], pRegisters, count * 4);
+}
+
+void Pca9685Shadow::SetPwmMs(int channel, double ms)
+{ // the same conversion as the PiPCA9685 library has
+    double periodMs = 1000.0 / this->frequencyHz;
+    int ticks = (int)(ms * 4096.0 / periodMs);
+
+    this->SetPwm(channel, 0, ticks > 4095 ? 4095 : ticks);
+}
+
+bool Pca9685Shadow::Flush()
+{ // returns false if success, true otherwise
+    std::lock_guard<std::mutex> lock(this->mutex);
+    int first = -1, last = -1;
+
+    // the changed channels from the first to the last one, those in between are rewritten too
+    for (int i = 0; i < PCA9685_CHANNELS; i++)
+    {
+        if (memcmp(&this->wanted[i * 4], &this->written[i * 4], 4) != 0)
+        {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+    }
+    if (first < 0)
+        return false;
+
+    unsigned char *pBuffer = &this->wanted[first * 4];
+    int count = (last - first + 1) * 4;
+    if (this->pDevice->Transact([first, pBuffer, count](I2CDEV *pDev)
+                                { return writeMultiDev(pDev, PCA9685_LED0_ON_L + first * 4, pBuffer, count); }) != 0)
+    { // the board keeps the old values, the next Flush() tries again
+        printf("ERROR:%s(): can't write the PCA9685 channels %d-%d\n", __func__, first, last);
+        return true;
+    }
+    memcpy(&this->written[first * 4], pBuffer, count);
+
+    return false;
+}
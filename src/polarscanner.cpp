@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include "polarscanner.h"
+
+extern bool debug;
+
+PolarScanner::PolarScanner(Servo *pScanServo, LaserSensor *pScanSensor, int binDegrees)
+{
+    this->pServo = pScanServo;
+    this->pSensor = pScanSensor;
+    this->pRangingScheduler = NULL;
+    this->minBinDegrees = binDegrees > 0 ? binDegrees : 1;
+    this->binDegrees = this->minBinDegrees;
+    this->binDistancesMm.assign(180 / this->binDegrees + 1, -1);
+    this->sampleCount = 0;
+}
+
+void PolarScanner::SetScheduler(RangingScheduler *pScheduler)
+{
+    this->pRangingScheduler = pScheduler;
+}
+
+bool PolarScanner::Scan(int fromDegrees, int toDegrees, float degreesPerSecond)
+{
+    bool ret = false;
+    int direction = toDegrees >= fromDegrees ? 1 : -1;
+    // the sample belongs to the middle of the ranging, not to its end
+    std::chrono::microseconds halfBudget(this->pSensor->GetTimingBudgetUs() / 2);
+
+    // the servo turns this much during a ranging (and a bit more for the bus traffic around it)
+    int degreesPerSample = (int)ceilf(degreesPerSecond * this->pSensor->GetTimingBudgetUs() * 1.25f / 1000000.0f);
+    this->binDegrees = degreesPerSample > this->minBinDegrees ? degreesPerSample : this->minBinDegrees;
+    this->binDistancesMm.assign(180 / this->binDegrees + 1, -1);
+    this->sampleCount = 0;
+    if (this->pRangingScheduler != NULL)
+        this->pRangingScheduler->Stop();
+
+    this->pServo->Move(fromDegrees);
+    this->pServo->WaitSettled();
+
+    // the servo is stepped once per ranging, the steps add up to the sweep speed
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    bool is_done = false;
+    while (!is_done)
+    {
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - startTime;
+        float target = fromDegrees + direction * degreesPerSecond * elapsed.count();
+        if ((target - toDegrees) * direction >= 0)
+        {
+            target = toDegrees;
+            is_done = this->pServo->IsSettled(); // one more round with the servo standing at the end
+        }
+        this->pServo->Move((int)lroundf(target));
+
+        RangeSample sample = this->pSensor->GetSample();
+        if (sample.distanceMm == TOF_TIMEOUT)
+        {
+            printf("ERROR:%s(): the sensor doesn't answer\n", __func__);
+            ret = true;
+            break;
+        }
+        this->AddSample(this->pServo->GetAngleAt(sample.time - halfBudget), sample);
+    }
+
+    if (this->pRangingScheduler != NULL)
+        this->pRangingScheduler->Start();
+    if (::debug)
+        printf("Polar scan: %d samples from %d to %d degrees in %lldms\n", this->sampleCount, fromDegrees, toDegrees,
+               (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count());
+
+    return ret;
+}
+
+void PolarScanner::AddSample(float angle, const RangeSample &sample)
+{ // the closest reading wins, an obstacle must not be averaged away
+    this->sampleCount++;
+    if (!sample.IsValid())
+        return;
+    int bin = (int)lroundf(angle / this->binDegrees);
+    if (bin < 0 || bin >= (int)this->binDistancesMm.size())
+        return;
+    if (this->binDistancesMm[bin] < 0 || sample.distanceMm < this->binDistancesMm[bin])
+        this->binDistancesMm[bin] = sample.distanceMm;
+}
+
+int PolarScanner::GetBinCount()
+{
+    return (int)this->binDistancesMm.size();
+}
+
+int PolarScanner::GetBinAngle(int bin)
+{
+    return bin * this->binDegrees;
+}
+
+int PolarScanner::GetBinDistanceMm(int bin)
+{
+    return bin >= 0 && bin < (int)this->binDistancesMm.size() ? this->binDistancesMm[bin] : -1;
+}
+
+int PolarScanner::FindBestGap(int minDistanceCm, int minWidthDegrees)
+{
+    int count = (int)this->binDistancesMm.size();
+    std::vector<int> distances(this->binDistancesMm);
+
+    // an empty bin gets the closer one of its nearest neighbours with a reading
+    for (int i = 0; i < count; i++)
+    {
+        if (this->binDistancesMm[i] >= 0)
+            continue;
+        int before = -1, after = -1;
+        for (int j = i - 1; j >= 0 && before < 0; j--)
+            before = this->binDistancesMm[j];
+        for (int j = i + 1; j < count && after < 0; j++)
+            after = this->binDistancesMm[j];
+        distances[i] = before < 0 ? after : (after < 0 ? before : (before < after ? before : after));
+    }
+
+    int bestStart = -1, bestWidth = 0;
+    for (int i = 0; i < count;)
+    {
+        if (distances[i] < 0 || distances[i] / 10 <= minDistanceCm)
+        {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < count && distances[i] / 10 > minDistanceCm)
+            i++;
+        int width = i - start;
+        // the wider one, or the one closer to straight ahead
+        if (width > bestWidth ||
+            (width == bestWidth && abs(this->GetBinAngle(start + width / 2) - 90) < abs(this->GetBinAngle(bestStart + bestWidth / 2) - 90)))
+        {
+            bestStart = start;
+            bestWidth = width;
+        }
+    }
+
+    if (bestStart < 0 || (bestWidth - 1) * this->binDegrees < minWidthDegrees)
+        return -1;
+
+    return this->GetBinAngle(bestStart + bestWidth / 2);
+}
@@ -1,13 +1,10 @@
-
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
-#include <chrono>
+#include <fcntl.h>
+#include <math.h>
 #include "pwm.h"
 
-#define PWM_SYSFS "/sys/class/pwm/pwmchip0/"
-#define PWM_PATH0 "/sys/class/pwm/pwmchip0/pwm0/"
-#define PWM_PATH1 "/sys/class/pwm/pwmchip0/pwm1/"
-
 // The purpose of this is that we can use the PWM ports of the Raspberry
 // The idea comes from: https://gist.github.com/Gadgetoid/b92ad3db06ff8c264eef2abf0e09d569
 // That is, first create a dts file named "pwm-pi5-overlay.dts" (part of the src directory),
@@ -19,59 +16,181 @@
 // dtoverlay=pwm-pi5
 // (To edit the config.txt file is tricky - I used "sudo vi")
 // Then, you are ready to use these methods below
-// These are currently not used - will be used in a future version
+// The TT motors can be driven from here (see Car::SetHardwarePwm()), the servo stays on the PCA9685
+
+PwmChannel::PwmChannel(int channel, const char *sysfsRoot)
+{
+    this->pwmChannel = channel;
+    snprintf(this->root, sizeof(this->root), "%s", sysfsRoot);
+    this->periodFd = -1;
+    this->dutyFd = -1;
+    this->enableFd = -1;
+    this->periodNs = 0;
+}
 
-PWM::PWM()
+PwmChannel::~PwmChannel()
 {
-    // nothing to do
+    this->Close();
 }
 
-bool PWM::Init(const char *period_ns, const char *duty_cycle_ns)
+int PwmChannel::OpenAttribute(const char *name)
 {
-    int chan = 0;
+    char path[192];
+
+    snprintf(path, sizeof(path), "%spwm%d/%s", this->root, this->pwmChannel, name);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        printf("ERROR:%s(): can't open file:%s\n", __func__, path);
+
+    return fd;
+}
+
+bool PwmChannel::Open(unsigned int periodNs)
+{ // returns false if success, true otherwise
+    char path[192];
+    char value[16];
     bool ret = false;
 
-    if (!ret)
-        ret = this->WriteSYS(PWM_SYSFS "export", "0"); // export PWM channel (0)
+    if (periodNs == 0)
+    {
+        printf("ERROR:%s(): the period must not be 0\n", __func__);
+        return true;
+    }
+    this->Close();
 
-    if (!ret)
-        ret = this->WriteSYS(PWM_SYSFS "export", "1"); // export PWM channel (1)
+    // the channel's directory shows up a bit after the export
+    snprintf(path, sizeof(path), "%spwm%d", this->root, this->pwmChannel);
+    if (access(path, F_OK) != 0)
+    {
+        snprintf(path, sizeof(path), "%sexport", this->root);
+        int fd = open(path, O_WRONLY);
+        if (fd >= 0)
+        {
+            int length = snprintf(value, sizeof(value), "%d\n", this->pwmChannel);
+            if (write(fd, value, length) != length)
+                printf("ERROR:%s(): can't export pwm%d\n", __func__, this->pwmChannel);
+            close(fd);
+        }
+        usleep(100000);
+    }
 
-    usleep(100000); // sleep for 100ms
+    this->periodFd = this->OpenAttribute("period");
+    this->dutyFd = this->OpenAttribute("duty_cycle");
+    this->enableFd = this->OpenAttribute("enable");
+    ret = this->periodFd < 0 || this->dutyFd < 0 || this->enableFd < 0;
 
+    // the duty cycle must not be longer than the period, not even for a moment
     if (!ret)
-        ret = this->WriteSYS(PWM_PATH0 "period", period_ns); // set period (1ms=1KHz)
+        ret = this->WriteValue(this->dutyFd, 0);
     if (!ret)
-        ret = this->WriteSYS(PWM_PATH0 "duty_cycle", duty_cycle_ns); // set duty_cycle
+        ret = this->WriteValue(this->periodFd, periodNs);
     if (!ret)
-        ret = this->WriteSYS(PWM_PATH0 "enable", "1"); // enable
-
-    if (!ret)
-        ret = this->WriteSYS(PWM_PATH1 "period", "50000"); // set period (just an example)
+        this->periodNs = periodNs;
     if (!ret)
-        ret = this->WriteSYS(PWM_PATH1 "duty_cycle", "25000"); // set duty_cycle (just an example)
-    if (!ret)
-        ret = this->WriteSYS(PWM_PATH1 "enable", "1"); // enable
+        ret = this->Enable(true);
+    if (ret)
+        this->Close();
 
     return ret;
 }
 
-bool PWM::WriteSYS(const char filename[], const char value[])
+void PwmChannel::Close()
 {
-    bool ret = false;
-    FILE *fp;                  // create a file pointer fp
-    fp = fopen(filename, "w"); // open file for writing
-    if (fp != NULL)
+    int *fds[] = {&this->periodFd, &this->dutyFd, &this->enableFd};
+
+    for (int *pFd : fds)
     {
-        // printf("PWM::WriteSYS(): Writing to [%s] value=[%s]\n", filename, value);
-        fprintf(fp, "%s", value); // send the value to the file
-        fclose(fp);               // close the file using fp
+        if (*pFd >= 0)
+            close(*pFd);
+        *pFd = -1;
     }
-    else
+    this->periodNs = 0;
+}
+
+bool PwmChannel::WriteValue(int fd, unsigned int value)
+{ // sysfs takes the whole value from the start of the file, the newline ends it
+    char text[16];
+    int length = snprintf(text, sizeof(text), "%u\n", value);
+
+    if (pwrite(fd, text, length, 0) != length)
     {
-        ret = true;
-        printf("ERROR: %s(): can't open file:%s\n", __func__, filename);
+        printf("ERROR:%s(): can't write %u to pwm%d\n", __func__, value, this->pwmChannel);
+        return true;
     }
 
-    return ret;
+    return false;
+}
+
+bool PwmChannel::SetDutyNs(unsigned int dutyNs)
+{ // returns false if success, true otherwise
+    if (this->dutyFd < 0)
+    {
+        printf("ERROR:%s(): pwm%d is not open\n", __func__, this->pwmChannel);
+        return true;
+    }
+
+    return this->WriteValue(this->dutyFd, dutyNs < this->periodNs ? dutyNs : this->periodNs);
+}
+
+bool PwmChannel::SetDuty(float duty)
+{ // returns false if success, true otherwise
+    duty = duty < 0.0f ? 0.0f : (duty > 1.0f ? 1.0f : duty);
+
+    return this->SetDutyNs((unsigned int)lroundf(duty * this->periodNs));
+}
+
+bool PwmChannel::Enable(bool enable)
+{
+    if (this->enableFd < 0)
+    {
+        printf("ERROR:%s(): pwm%d is not open\n", __func__, this->pwmChannel);
+        return true;
+    }
+
+    return this->WriteValue(this->enableFd, enable ? 1 : 0);
+}
+
+PWM::PWM(const char *sysfsRoot)
+{
+    snprintf(this->root, sizeof(this->root), "%s", sysfsRoot);
+    for (int i = 0; i < PWM_CHANNELS; i++)
+        this->pChannels[i] = NULL;
+}
+
+PWM::~PWM()
+{
+    for (int i = 0; i < PWM_CHANNELS; i++)
+        delete this->pChannels[i];
+}
+
+bool PWM::SetupChannel(int channel, unsigned int periodNs)
+{ // returns false if success, true otherwise
+    if (channel < 0 || channel >= PWM_CHANNELS)
+    {
+        printf("ERROR:%s(): no channel %d\n", __func__, channel);
+        return true;
+    }
+
+    if (this->pChannels[channel] == NULL)
+        this->pChannels[channel] = new PwmChannel(channel, this->root);
+
+    return this->pChannels[channel]->Open(periodNs);
+}
+
+bool PWM::SetDuty(int channel, float duty)
+{ // returns false if success, true otherwise
+    PwmChannel *pChannel = this->GetChannel(channel);
+
+    if (pChannel == NULL)
+    {
+        printf("ERROR:%s(): channel %d is not set up\n", __func__, channel);
+        return true;
+    }
+
+    return pChannel->SetDuty(duty);
+}
+
+PwmChannel *PWM::GetChannel(int channel)
+{
+    return channel >= 0 && channel < PWM_CHANNELS ? this->pChannels[channel] : NULL;
 }
@@ -0,0 +1,112 @@
+#include "rangefilter.h"
+
+RangeFilter::RangeFilter()
+{
+    this->config = {true, false, 0.0f, 1, 1.0f, 0.0f, 0.0f};
+    this->Reset();
+}
+
+RangeFilter::RangeFilter(const RangeFilterConfig &filterConfig)
+{
+    this->SetConfig(filterConfig);
+}
+
+void RangeFilter::SetConfig(const RangeFilterConfig &filterConfig)
+{
+    this->config = filterConfig;
+    if (this->config.medianWindow < 1)
+        this->config.medianWindow = 1;
+    if (this->config.medianWindow > MAX_MEDIAN_WINDOW)
+        this->config.medianWindow = MAX_MEDIAN_WINDOW;
+    this->Reset();
+}
+
+void RangeFilter::Reset()
+{
+    this->filtered = {TOF_NOT_READY, 0, 0, 0, std::chrono::steady_clock::time_point()};
+    this->windowCount = 0;
+    this->windowNext = 0;
+    this->has_value = false;
+}
+
+bool RangeFilter::Add(const RangeSample &sample)
+{
+    if (sample.distanceMm < 0)
+        return true; // no reading at all
+    if (this->config.passNoTarget && sample.rangeStatus == TOF_NO_TARGET)
+    { // nothing came back: it must not be filtered away, and the readings before it don't belong to the next ones
+        this->Reset();
+        this->filtered = sample;
+        return false;
+    }
+    if (this->config.rejectInvalid && sample.rangeStatus != TOF_RANGE_COMPLETE)
+        return true;
+    if (sample.signalRateMcps < this->config.minSignalRateMcps)
+        return true;
+
+    float value = (float)sample.distanceMm;
+
+    if (this->config.medianWindow > 1)
+        value = this->Median(value);
+
+    if (this->config.smoothingAlpha < 1.0f)
+    {
+        if (this->has_value)
+            value = this->smoothed + this->config.smoothingAlpha * (value - this->smoothed);
+        this->smoothed = value;
+    }
+
+    if (this->config.kalmanProcessNoise > 0.0f)
+    {
+        if (!this->has_value)
+        {
+            this->estimate = value;
+            this->variance = this->config.kalmanMeasurementNoise;
+        }
+        else
+        {
+            this->variance += this->config.kalmanProcessNoise; // predict: the distance is about the same
+            float gain = this->variance / (this->variance + this->config.kalmanMeasurementNoise);
+            this->estimate += gain * (value - this->estimate);
+            this->variance *= (1.0f - gain);
+        }
+        value = this->estimate;
+    }
+
+    this->has_value = true;
+    this->filtered = sample;
+    this->filtered.distanceMm = (int)(value + 0.5f);
+
+    return false;
+}
+
+RangeSample RangeFilter::Get() const
+{
+    return this->filtered;
+}
+
+float RangeFilter::Median(float value)
+{ // the oldest value leaves the sorted copy, the new one is inserted in its place
+    int size = this->config.medianWindow;
+    int i;
+
+    if (this->windowCount == size)
+    {
+        float oldest = this->window[this->windowNext];
+        for (i = 0; i < this->windowCount && this->sorted[i] != oldest; i++)
+            ;
+        for (; i < this->windowCount - 1; i++)
+            this->sorted[i] = this->sorted[i + 1];
+        this->windowCount--;
+    }
+
+    this->window[this->windowNext] = value;
+    this->windowNext = (this->windowNext + 1) % size;
+
+    for (i = this->windowCount; i > 0 && this->sorted[i - 1] > value; i--)
+        this->sorted[i] = this->sorted[i - 1];
+    this->sorted[i] = value;
+    this->windowCount++;
+
+    return this->sorted[this->windowCount / 2];
+}
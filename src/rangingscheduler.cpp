@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "rangingscheduler.h"
+
+extern bool debug;
+
+RangingScheduler::RangingScheduler(LaserSensor *pSensors[], int count)
+{
+    this->sensorCount = count < MAX_SCHEDULED_SENSORS ? count : MAX_SCHEDULED_SENSORS;
+    for (int i = 0; i < this->sensorCount; i++)
+    {
+        this->pLaserSensors[i] = pSensors[i];
+        this->validCounts[i] = 0;
+        for (int j = 0; j < this->sensorCount; j++)
+            this->interferes[i][j] = false;
+    }
+    this->is_running = false;
+    this->startTime = std::chrono::steady_clock::now();
+    this->is_cycle_failed = false;
+    this->cycleCount = 0;
+    this->BuildSlots();
+}
+
+RangingScheduler::~RangingScheduler()
+{
+    this->Stop();
+}
+
+int RangingScheduler::IndexOf(LaserSensor *pSensor)
+{
+    for (int i = 0; i < this->sensorCount; i++)
+    {
+        if (this->pLaserSensors[i] == pSensor)
+            return i;
+    }
+    return -1;
+}
+
+void RangingScheduler::SetInterference(LaserSensor *pSensorA, LaserSensor *pSensorB, bool interfere)
+{ // call BuildSlots() after the changes
+    int a = this->IndexOf(pSensorA);
+    int b = this->IndexOf(pSensorB);
+
+    if (a < 0 || b < 0 || a == b)
+    {
+        printf("ERROR:%s(): the sensors are not scheduled here\n", __func__);
+        return;
+    }
+    this->interferes[a][b] = interfere;
+    this->interferes[b][a] = interfere;
+}
+
+// Compares each sensor's readings alone with its readings while another one
+// is ranging too: if the average moves or the valid readings get fewer, the pair interferes
+bool RangingScheduler::SelfTest(int sampleCount, int toleranceMm)
+{
+    bool ret = false;
+    double aloneMm[MAX_SCHEDULED_SENSORS];
+    int aloneValid[MAX_SCHEDULED_SENSORS];
+
+    for (int i = 0; i < this->sensorCount; i++)
+    {
+        double sum = 0;
+        aloneValid[i] = 0;
+        for (int k = 0; k < sampleCount; k++)
+        {
+            RangeSample sample = this->pLaserSensors[i]->GetSample();
+            if (sample.IsValid())
+            {
+                sum += sample.distanceMm;
+                aloneValid[i]++;
+            }
+        }
+        if (aloneValid[i] == 0)
+        {
+            printf("ERROR:%s(): sensor %d has no valid reading, it can't be tested\n", __func__, i);
+            ret = true;
+        }
+        aloneMm[i] = aloneValid[i] > 0 ? sum / aloneValid[i] : 0;
+    }
+
+    for (int i = 0; i < this->sensorCount; i++)
+    {
+        for (int j = i + 1; j < this->sensorCount; j++)
+        {
+            LaserSensor *pPair[] = {this->pLaserSensors[i], this->pLaserSensors[j]};
+            RangeSample samples[2];
+            double sum[2] = {0, 0};
+            int valid[2] = {0, 0};
+
+            for (int k = 0; k < sampleCount; k++)
+            {
+                LaserSensor::GetSamples(pPair, 2, samples);
+                for (int p = 0; p < 2; p++)
+                {
+                    if (samples[p].IsValid())
+                    {
+                        sum[p] += samples[p].distanceMm;
+                        valid[p]++;
+                    }
+                }
+            }
+
+            bool interfere = false;
+            int index[2] = {i, j};
+            for (int p = 0; p < 2; p++)
+            {
+                int n = index[p];
+                if (aloneValid[n] == 0)
+                    continue;
+                if (valid[p] < aloneValid[n] - sampleCount / 5 ||
+                    (valid[p] > 0 && abs((int)(sum[p] / valid[p] - aloneMm[n])) > toleranceMm))
+                    interfere = true;
+            }
+            this->interferes[i][j] = interfere;
+            this->interferes[j][i] = interfere;
+            if (::debug)
+                printf("Laser sensors %d and %d %s\n", i, j, interfere ? "interfere" : "don't interfere");
+        }
+    }
+
+    this->BuildSlots();
+    return ret;
+}
+
+void RangingScheduler::BuildSlots()
+{ // greedy graph coloring: the sensor with the most conflicts first, into the first slot it fits in
+    int order[MAX_SCHEDULED_SENSORS];
+    int degree[MAX_SCHEDULED_SENSORS];
+
+    for (int i = 0; i < this->sensorCount; i++)
+    {
+        order[i] = i;
+        degree[i] = 0;
+        this->slotOf[i] = -1;
+        for (int j = 0; j < this->sensorCount; j++)
+            degree[i] += this->interferes[i][j] ? 1 : 0;
+    }
+    for (int i = 1; i < this->sensorCount; i++)
+    {
+        for (int j = i; j > 0 && degree[order[j]] > degree[order[j - 1]]; j--)
+        {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+
+    this->slotCount = 0;
+    for (int k = 0; k < this->sensorCount; k++)
+    {
+        int n = order[k];
+        int slot = 0;
+        for (int j = 0; j < this->sensorCount; j++)
+        {
+            if (this->slotOf[j] == slot && this->interferes[n][j])
+            { // taken by an interfering one, try the next slot from the beginning
+                slot++;
+                j = -1;
+            }
+        }
+        this->slotOf[n] = slot;
+        if (slot + 1 > this->slotCount)
+            this->slotCount = slot + 1;
+    }
+}
+
+int RangingScheduler::GetSlotCount()
+{
+    return this->slotCount;
+}
+
+int RangingScheduler::GetSlot(LaserSensor *pSensor)
+{
+    int i = this->IndexOf(pSensor);
+
+    return i < 0 ? -1 : this->slotOf[i];
+}
+
+bool RangingScheduler::RunCycle(RangeSample samples[])
+{
+    bool ret = false;
+
+    for (int slot = 0; slot < this->slotCount; slot++)
+    {
+        LaserSensor *pSlotSensors[MAX_SCHEDULED_SENSORS];
+        RangeSample slotSamples[MAX_SCHEDULED_SENSORS];
+        int index[MAX_SCHEDULED_SENSORS];
+        int n = 0;
+
+        for (int i = 0; i < this->sensorCount; i++)
+        {
+            if (this->slotOf[i] == slot)
+            {
+                pSlotSensors[n] = this->pLaserSensors[i];
+                index[n++] = i;
+            }
+        }
+
+        // the sensors of a slot range at the same time
+        if (LaserSensor::GetSamples(pSlotSensors, n, slotSamples))
+            ret = true;
+        for (int k = 0; k < n; k++)
+        {
+            samples[index[k]] = slotSamples[k];
+            if (slotSamples[k].IsValid())
+                this->validCounts[index[k]]++;
+        }
+    }
+
+    return ret;
+}
+
+bool RangingScheduler::Start()
+{ // returns false if success, true otherwise
+    if (this->is_running)
+        return false;
+
+    for (int i = 0; i < this->sensorCount; i++)
+        this->validCounts[i] = 0;
+    this->startTime = std::chrono::steady_clock::now();
+    this->is_running = true;
+    this->worker = std::thread(&RangingScheduler::Run, this);
+
+    return false;
+}
+
+void RangingScheduler::Stop()
+{
+    this->is_running = false;
+    if (this->worker.joinable())
+        this->worker.join();
+}
+
+void RangingScheduler::Run()
+{ // the results are each sensor's latest sample, e.g. for the sensor sampler
+    RangeSample samples[MAX_SCHEDULED_SENSORS];
+
+    while (this->is_running)
+    {
+        bool is_failed = this->RunCycle(samples);
+        {
+            std::lock_guard<std::mutex> lock(this->cycleMutex);
+            for (int i = 0; i < this->sensorCount; i++)
+                this->cycleSamples[i] = samples[i];
+            this->is_cycle_failed = is_failed;
+            this->cycleCount++;
+        }
+        this->cycleDone.notify_all();
+    }
+
+    { // the waiting ones don't wait for the timeout
+        std::lock_guard<std::mutex> lock(this->cycleMutex);
+    }
+    this->cycleDone.notify_all();
+}
+
+bool RangingScheduler::WaitCycle(LaserSensor *pSensors[], int count, RangeSample samples[])
+{ // with the thread running, a cycle here would range beside its slots: its next cycles are waited for
+    RangeSample results[MAX_SCHEDULED_SENSORS];
+    bool ret = false;
+    bool is_missing = false;
+
+    if (!this->is_running)
+        ret = this->RunCycle(results);
+    else
+    {
+        std::unique_lock<std::mutex> lock(this->cycleMutex);
+        unsigned int target = this->cycleCount + 2; // the one in progress may have started before the call
+        this->cycleDone.wait_for(lock, std::chrono::seconds(1),
+                                 [this, target] { return this->cycleCount >= target || !this->is_running; });
+        if (this->cycleCount < target)
+        {
+            printf("ERROR:%s(): no ranging cycle came\n", __func__);
+            is_missing = true;
+        }
+        for (int i = 0; i < this->sensorCount; i++)
+            results[i] = this->cycleSamples[i];
+        ret = is_missing || this->is_cycle_failed;
+    }
+
+    for (int i = 0; i < count; i++)
+    { // the last cycle's samples are old if the new one didn't come
+        int n = this->IndexOf(pSensors[i]);
+        if (n < 0 || is_missing)
+            samples[i] = {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()};
+        else
+            samples[i] = results[n];
+        if (n < 0)
+            ret = true;
+    }
+
+    return ret;
+}
+
+float RangingScheduler::GetSampleRateHz(LaserSensor *pSensor)
+{
+    int i = this->IndexOf(pSensor);
+    std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - this->startTime;
+
+    if (i < 0 || elapsed.count() <= 0)
+        return 0;
+
+    return this->validCounts[i] / elapsed.count();
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include "sensorsampler.h"
+
+SensorSampler::SensorSampler(LaserSensor *pFwrdSensor, LaserSensor *pLftSensor, LaserSensor *pRghtSensor,
+                             LaserSensor *pFlrSensor, Lsm6dsoxLis3mdl *pImu)
+{
+    this->pForwardSensor = pFwrdSensor;
+    this->pLeftSensor = pLftSensor;
+    this->pRightSensor = pRghtSensor;
+    this->pFloorSensor = pFlrSensor;
+    this->pLsmLis = pImu;
+    this->pServo = NULL;
+    this->samplingPeriodMs = 10;
+    this->is_running = false;
+}
+
+SensorSampler::~SensorSampler()
+{
+    this->Stop();
+}
+
+bool SensorSampler::Start(int periodMs)
+{ // returns false if success, true otherwise
+    if (this->is_running)
+        return false;
+
+    this->samplingPeriodMs = periodMs;
+    this->is_running = true;
+    this->worker = std::thread(&SensorSampler::Run, this);
+
+    return false;
+}
+
+void SensorSampler::Stop()
+{
+    this->is_running = false;
+    if (this->worker.joinable())
+        this->worker.join();
+}
+
+SensorSnapshot SensorSampler::GetSnapshot() const
+{
+    return this->snapshot.Read();
+}
+
+void SensorSampler::SetFilter(LaserSensor *pSensor, const RangeFilterConfig &config)
+{
+    LaserSensor *pSensors[] = {this->pForwardSensor, this->pLeftSensor, this->pRightSensor, this->pFloorSensor};
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (pSensors[i] == pSensor)
+            this->filters[i].SetConfig(config);
+    }
+}
+
+void SensorSampler::SetServo(Servo *pSensorServo)
+{
+    this->pServo = pSensorServo;
+}
+
+void SensorSampler::Run()
+{
+    SensorSnapshot current = this->snapshot.Read();
+    LaserSensor *pSensors[] = {this->pForwardSensor, this->pLeftSensor, this->pRightSensor, this->pFloorSensor};
+    RangeSample *pFiltered[] = {&current.forward, &current.left, &current.right, &current.floor};
+    std::chrono::steady_clock::time_point lastTimes[4];
+    std::chrono::steady_clock::time_point lastSettledTime;
+    std::chrono::steady_clock::time_point nextTime = std::chrono::steady_clock::now();
+
+    while (this->is_running)
+    {
+        // the laser sensors only give their result if there is a new one,
+        // otherwise it is their last one with its time; each new one goes through the filter
+        for (int i = 0; i < 4; i++)
+        {
+            RangeSample sample = pSensors[i]->GetLatestSample();
+            bool is_seen_moving = false;
+            if (pSensors[i] == this->pForwardSensor && this->pServo != NULL)
+            { // after a move of the servo, the earlier readings are from another direction
+                std::chrono::steady_clock::time_point settledTime = this->pServo->GetSettledTime();
+                if (settledTime != lastSettledTime)
+                {
+                    lastSettledTime = settledTime;
+                    this->filters[i].Reset();
+                }
+                // the whole integration has to be after it got there
+                is_seen_moving = sample.time - std::chrono::microseconds(pSensors[i]->GetTimingBudgetUs()) < settledTime;
+            }
+            if (sample.distanceMm != TOF_NOT_READY && sample.time != lastTimes[i] && !is_seen_moving)
+            {
+                lastTimes[i] = sample.time;
+                this->filters[i].Add(sample);
+            }
+            *pFiltered[i] = this->filters[i].Get();
+        }
+
+        if (this->pLsmLis != NULL)
+        {
+            unsigned char fresh = this->pLsmLis->ReadRawValues(current.accelRaw, current.gyroRaw, current.compassRaw);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (fresh & 1)
+                current.accelTime = now;
+            if (fresh & 2)
+                current.gyroTime = now;
+            if (fresh & 4)
+                current.compassTime = now;
+        }
+
+        this->snapshot.Write(current);
+
+        // a steady rate, the time of the reading doesn't add up
+        nextTime += std::chrono::milliseconds(this->samplingPeriodMs);
+        if (nextTime < std::chrono::steady_clock::now())
+            nextTime = std::chrono::steady_clock::now(); // fell behind, don't try to catch up
+        std::this_thread::sleep_until(nextTime);
+    }
+}
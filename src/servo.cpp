@@ -1,29 +1,90 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 #include <gpiod.h>
 #include <unistd.h>
 #include <chrono>
+#include <thread>
 #include "servo.h"
-#include <PCA9685.h>
+#include "pca9685shadow.h"
 
-extern PiPCA9685::PCA9685 *pPCA;
+extern Pca9685Shadow *pPcaOutputs;
 
-Servo::Servo(int pin)
+Servo::Servo(int pin, float msPer60Degrees, int settleMs)
 {
   this->pca9685Pin = pin;
   this->lastPosition = -1;
+  this->msPer60Degrees = msPer60Degrees;
+  this->settleMs = settleMs;
+  this->settledTime = std::chrono::steady_clock::now();
+  this->moveStartTime = this->settledTime.load();
+  this->moveFromPosition = 90;
+}
+
+void Servo::SetSpeedModel(float msPer60Degrees, int settleMs)
+{ // e.g. slower on a low battery or with a heavier sensor head
+  this->msPer60Degrees = msPer60Degrees;
+  this->settleMs = settleMs;
 }
 
 // This is for the SG90 mini-servo.
 // Its duty cycle is 50Hz (20ms) while the pulse-with is a few ms
-void Servo::Move(int position) // position: 0-180
+int Servo::Move(int position) // position: 0-180
 {
   if(position != this->lastPosition)
   {
     // 0.5: 0degree, 1.5ms:90degree, 2.5ms:180 degree
     double value = 2.0 * (((double)position) / 180.0) + 0.5;
     // printf("pin:%d, value=%f\n", this->pca9685Pin, value);
-    pPCA->set_pwm_ms(this->pca9685Pin, value);
+    pPcaOutputs->SetPwmMs(this->pca9685Pin, value);
+    pPcaOutputs->Flush();
+
+    // if it is still on the way, it goes on from where it is now;
+    // the position is unknown before the first move: assume the longest way
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    float from = this->lastPosition < 0 ? (position < 90 ? 180.0f : 0.0f) : this->GetAngleAt(now);
+    int travelMs = (int)(fabsf(position - from) * this->msPer60Degrees / 60.0f);
+    this->moveStartTime = now;
+    this->moveFromPosition = from;
+    this->settledTime = now + std::chrono::milliseconds(travelMs + this->settleMs);
     this->lastPosition = position;
-    usleep(250000); // wait 0.25 seconds
   }
-}
\ No newline at end of file
+
+  return this->GetRemainingMs();
+}
+
+int Servo::GetRemainingMs()
+{
+  std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(this->settledTime.load() - std::chrono::steady_clock::now());
+
+  return remaining.count() > 0 ? (int)remaining.count() : 0;
+}
+
+bool Servo::IsSettled()
+{
+  return std::chrono::steady_clock::now() >= this->settledTime.load();
+}
+
+void Servo::WaitSettled()
+{
+  std::this_thread::sleep_until(this->settledTime.load());
+}
+
+std::chrono::steady_clock::time_point Servo::GetSettledTime()
+{ // a reading of the sensor on the servo is only good if it was taken after this
+  return this->settledTime;
+}
+
+float Servo::GetAngleAt(std::chrono::steady_clock::time_point time)
+{ // it turns at a constant speed from the start of the last move, then rings a bit at the end
+  if (this->lastPosition < 0)
+    return this->moveFromPosition;
+  std::chrono::duration<float, std::milli> travel = this->settledTime.load() - this->moveStartTime - std::chrono::milliseconds(this->settleMs);
+  std::chrono::duration<float, std::milli> elapsed = time - this->moveStartTime;
+  if (elapsed.count() <= 0)
+    return this->moveFromPosition;
+  if (elapsed >= travel)
+    return this->lastPosition;
+
+  return this->moveFromPosition + (this->lastPosition - this->moveFromPosition) * elapsed.count() / travel.count();
+}
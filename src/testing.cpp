@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include <math.h>
+#include <chrono>
 #include "testing.h"
 #include "servo.h"
 #include "car.h"
@@ -9,6 +12,9 @@
 #include "texttospeech.h"
 #include "speechtotext.h"
 #include "lsm6dsox_lis3mdl.h"
+#include "i2cdevice.h"
+#include "pwm.h"
+#include "headingestimator.h"
 
 #define PI 3.14159265358979323846
 
@@ -21,6 +27,7 @@ extern LaserSensor *pFloorSensor;
 extern TextToSpeech *pTextToSpeech;
 extern SpeechToText *pSpeechToText;
 extern Lsm6dsoxLis3mdl *pLsmLis;
+extern HeadingEstimator *pHeadingEstimator;
 extern const char *myGoogleProjectId;
 
 // various testing routines to test the individual features one by one
@@ -118,6 +125,9 @@ void Testing::TestGyro()
   int dt = (int) (1000.0 / (double) freq); // millisecond
   int loopLength = 2 * 1000 / dt; // 2 sec
 
+  // the FIFO is read here, not by the estimator's thread
+  if(pHeadingEstimator != NULL)
+    pHeadingEstimator->Stop();
   for(int i = 0; i < max; i++)
   {
     printf("Hit enter when ready to turn and start turning.\n");
@@ -125,15 +135,175 @@ void Testing::TestGyro()
     pLsmLis->CalculateAcceleratorAveBias();
     pLsmLis->CalculateGyroAveBias();
     pLsmLis->lastGyroAngles = { 0, 0, 0 };
+    // the same turn integrated from every sample of the FIFO, with the chip's timestamps
+    std::vector<Lsm6dsoxLis3mdl::FifoSample> samples;
+    Lsm6dsoxLis3mdl::vector<double> fifoAngles = { 0, 0, 0 };
+    int fifoWords = 0;
+    size_t integrated = 0;
+    pLsmLis->StartFifo();
     printf("Loop starts\n");
     for(int t = 0; t < loopLength; t++)
     {
       pLsmLis->lastGyroAngles = pLsmLis->GetGyroAngles(dt, pLsmLis->lastGyroAngles);
       //printf("Gyro angles: x=%f y=%f z=%f\n", pLsmLis->lastGyroAngles.x, pLsmLis->lastGyroAngles.y, pLsmLis->lastGyroAngles.z);      
+      fifoWords += pLsmLis->ReadFifo(samples);
+      for(; integrated < samples.size(); integrated++)
+      {
+        if(integrated == 0 || !(samples[integrated].fresh & 2))
+          continue;
+        double seconds = (uint32_t)(samples[integrated].timestamp - samples[integrated - 1].timestamp) * LSM6DSOX_TIMESTAMP_LSB_US / 1000000.0;
+        Lsm6dsoxLis3mdl::vector<double> rates = pLsmLis->GyroRawToDps(samples[integrated].gyro);
+        fifoAngles.x += rates.x * seconds;
+        fifoAngles.y += rates.y * seconds;
+        fifoAngles.z += rates.z * seconds;
+      }
       usleep(dt * 1000);
     }
+    pLsmLis->StopFifo();
     printf("Stop turning\n");
     printf("Final Gyro angles: x=%f y=%f z=%f\n", pLsmLis->lastGyroAngles.x, pLsmLis->lastGyroAngles.y, pLsmLis->lastGyroAngles.z);
+    printf("FIFO Gyro angles: x=%f y=%f z=%f (%d samples, %d words read)\n", fifoAngles.x, fifoAngles.y, fifoAngles.z,
+           (int)samples.size(), fifoWords);
   }
+
+  if(pHeadingEstimator != NULL)
+    pHeadingEstimator->Start();
 }
 
+
+// measures how many register reads per second the i2c bus sustains
+// with the separate write()+read() syscalls and with the combined I2C_RDWR transfers
+void Testing::TestI2CThroughput(int slaveAddress, int readCount)
+{
+  bool lastMode = tofGetCombinedTransfers();
+  I2cDevice device(slaveAddress);
+
+  if (device.Open())
+  {
+    printf("ERROR: can't talk to slave 0x%x\n", slaveAddress);
+    return;
+  }
+
+  for (int combined = 0; combined <= 1; combined++)
+  {
+    if (tofSetCombinedTransfers(combined == 1))
+    {
+      printf("Combined transfers are not supported by the i2c adapter\n");
+      continue;
+    }
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < readCount; i++)
+      device.ReadReg(0xc0); // VL53L0X model id
+    std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+
+    std::chrono::microseconds duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    printf("%s: %d reads in %lldus, %.0f transactions/s, %.1fus/read\n",
+           (combined ? "I2C_RDWR" : "write()+read()"), readCount, (long long)duration.count(),
+           readCount * 1000000.0 / duration.count(), ((double)duration.count()) / readCount);
+  }
+
+  tofSetCombinedTransfers(lastMode);
+}
+
+// measures how long a laser sensor's initialization takes
+// with one write() per register and with the batched register lists
+void Testing::TestLaserSensorInitTime(LaserSensor *pSensor, int repeatCount)
+{
+  bool lastMode = tofGetCombinedTransfers();
+
+  for (int combined = 0; combined <= 1; combined++)
+  {
+    if (tofSetCombinedTransfers(combined == 1))
+    {
+      printf("Combined transfers are not supported by the i2c adapter\n");
+      continue;
+    }
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeatCount; i++)
+      pSensor->Init();
+    std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+
+    std::chrono::microseconds duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+    printf("%s: sensor init takes %.1fms\n", (combined ? "I2C_RDWR" : "write()"),
+           ((double)duration.count()) / repeatCount / 1000.0);
+  }
+
+  tofSetCombinedTransfers(lastMode);
+}
+
+// reads back a value the PWM channel has written into the fake sysfs tree
+static unsigned int ReadFakeAttribute(const char *dir, const char *name)
+{
+  char path[192];
+  unsigned int value = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *fp = fopen(path, "r");
+  if (fp != NULL)
+  {
+    if (fscanf(fp, "%u", &value) != 1)
+      value = 0;
+    fclose(fp);
+  }
+
+  return value;
+}
+
+void Testing::TestPwmChannel(int updateCount)
+{ // against a fake pwmchip directory: the writes can be checked, and the update rate is the syscalls' one
+  char root[] = "/tmp/pwmtestXXXXXX";
+  char dir[64];
+  char path[192];
+  const char *attributes[] = {"period", "duty_cycle", "enable"};
+
+  if (mkdtemp(root) == NULL)
+  {
+    printf("ERROR: can't create the fake sysfs tree\n");
+    return;
+  }
+  snprintf(dir, sizeof(dir), "%s/pwm0", root);
+  mkdir(dir, 0700);
+  for (const char *name : attributes)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "w");
+    if (fp != NULL)
+    {
+      fprintf(fp, "0\n");
+      fclose(fp);
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/", root);
+  PwmChannel channel(0, path);
+  bool failed = channel.Open(50000);
+  if (!failed)
+    failed = ReadFakeAttribute(dir, "period") != 50000 || ReadFakeAttribute(dir, "enable") != 1 ||
+             ReadFakeAttribute(dir, "duty_cycle") != 0;
+  if (!failed)
+    failed = channel.SetDuty(0.25f) || ReadFakeAttribute(dir, "duty_cycle") != 12500;
+  if (!failed)
+    failed = channel.SetDuty(2.0f) || ReadFakeAttribute(dir, "duty_cycle") != 50000; // no longer than the period
+  printf("PwmChannel on a fake sysfs tree: %s\n", failed ? "FAILED" : "OK");
+
+  if (!failed)
+  {
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < updateCount; i++)
+      channel.SetDuty((float)(i % 100) / 100.0f);
+    std::chrono::microseconds duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+    printf("%d duty updates in %lldus, %.0f updates/s\n", updateCount, (long long)duration.count(),
+           updateCount * 1000000.0 / (duration.count() > 0 ? duration.count() : 1));
+  }
+
+  channel.Close();
+  for (const char *name : attributes)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    unlink(path);
+  }
+  rmdir(dir);
+  rmdir(root);
+}
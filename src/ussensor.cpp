@@ -2,6 +2,7 @@
 #include <gpiod.h>
 #include "ussensor.h"
 #include <unistd.h>
+#include <time.h>
 #include <chrono>
 
 extern struct gpiod_chip *pChip;
@@ -11,15 +12,23 @@ extern struct gpiod_chip *pChip;
 // but soft material (carpet, etc.) is invisible for them, therefore they are 
 // pretty useless for object detection since some objects they just don't see.
 // The VL53L0X time of flight sensor doesn't have this problem as far as I can see. 
+// (But they see glass, which the VL53L0X doesn't, so they can be a second opinion.)
+// The echo pulse is measured from the kernel's timestamps of its edges,
+// there is no busy waiting.
 
-UsSensor::UsSensor(int triggerGpio, int echoGpio)
+UsSensor::UsSensor(int triggerGpio, int echoGpio, int timeoutMs)
 {
+    this->echoTimeoutMs = timeoutMs;
+    this->is_measuring = false;
+    this->has_rising_edge = false;
+
     pLineTrigger = gpiod_chip_get_line(::pChip, triggerGpio);
     pLineEcho = gpiod_chip_get_line(::pChip, echoGpio);
 
     // Open trigger line for output
     gpiod_line_request_output(pLineTrigger, "example1", 0);
-    gpiod_line_request_input(pLineEcho, "example1");
+    if (gpiod_line_request_both_edges_events(pLineEcho, "example1") != 0)
+        printf("ERROR:%s(): failed to request the echo line events\n", __func__);
 }
 
 void UsSensor::ReleaseGpioLines()
@@ -30,32 +39,114 @@ void UsSensor::ReleaseGpioLines()
 
 float UsSensor::GetDistanceCm()
 {
-    float distance = -1;
+    RangeSample sample = this->GetSample();
+
+    if (!sample.IsValid())
+        return -1;
+
+    return sample.distanceMm / 10.0f;
+}
+
+RangeSample UsSensor::GetSample()
+{
+    RangeSample sample;
+
+    if (this->StartMeasurement())
+        return {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()};
+
+    // sleeps in the kernel until an edge comes or the time is up
+    std::chrono::steady_clock::time_point deadline = this->triggerTime + std::chrono::milliseconds(this->echoTimeoutMs);
+    while (true)
+    {
+        std::chrono::microseconds left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+        if (this->ReadEchoEvents(left.count() > 0 ? (int)left.count() : 0, sample))
+            return sample;
+        if (left.count() <= 0)
+            break;
+    }
+    this->is_measuring = false;
+
+    return {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()};
+}
+
+bool UsSensor::StartMeasurement()
+{
+    RangeSample stale;
+    bool ret = false;
+
+    this->ReadEchoEvents(0, stale); // the edges of an earlier pulse don't count
+    this->has_rising_edge = false;
 
     if (gpiod_line_set_value(pLineTrigger, 0) != 0)
         printf("ERROR:%s(): faild to set trigger line to 0\n", __func__);
     usleep(2);
     if (gpiod_line_set_value(pLineTrigger, 1) != 0)
+    {
         printf("ERROR:%s(): faild to set trigger line to 1\n", __func__);
+        ret = true;
+    }
     usleep(10);
     if (gpiod_line_set_value(pLineTrigger, 0) != 0)
         printf("ERROR:%s(): faild to set trigger line to 0 again\n", __func__);
 
-    int count1 = 1;
-    while (gpiod_line_get_value(pLineEcho) == 0)
-        count1++;
-    // printf("Waited for 0 for %d\n", count1);
+    this->triggerTime = std::chrono::steady_clock::now();
+    this->is_measuring = !ret;
+
+    return ret;
+}
+
+bool UsSensor::IsMeasurementDone(RangeSample &sample)
+{ // true if the echo is measured (or it is not coming any more), sample has the result then
+    if (!this->is_measuring)
+        return false;
 
-    auto start = std::chrono::high_resolution_clock::now();
+    if (this->ReadEchoEvents(0, sample))
+        return true;
 
-    int count2 = 1;
-    while (gpiod_line_get_value(pLineEcho) == 1)
-        count2++;
-    // printf("Waited for 1 for %d\n", count2);
+    if (std::chrono::steady_clock::now() - this->triggerTime > std::chrono::milliseconds(this->echoTimeoutMs))
+    {
+        this->is_measuring = false;
+        sample = {TOF_TIMEOUT, 0, 0, 0, std::chrono::steady_clock::now()};
+        return true;
+    }
 
-    auto stop = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-    distance = duration.count() * 0.0343 / 2;
+    return false;
+}
 
-    return distance;
-}
\ No newline at end of file
+bool UsSensor::ReadEchoEvents(int waitUs, RangeSample &sample)
+{ // reads the edges that came (waits for the first one at most waitUs), true if the pulse is complete
+    struct timespec timeout = {(time_t)(waitUs / 1000000), (long)(waitUs % 1000000) * 1000};
+    struct gpiod_line_event event;
+
+    while (gpiod_line_event_wait(pLineEcho, &timeout) == 1)
+    {
+        if (gpiod_line_event_read(pLineEcho, &event) != 0)
+        {
+            printf("ERROR:%s(): gpiod_line_event_read failed.\n", __func__);
+            break;
+        }
+        timeout = {0, 0};
+
+        // the edges are stamped with CLOCK_MONOTONIC, which is steady_clock's
+        std::chrono::steady_clock::time_point edgeTime(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::seconds(event.ts.tv_sec) + std::chrono::nanoseconds(event.ts.tv_nsec)));
+
+        if (event.event_type == GPIOD_LINE_EVENT_RISING_EDGE)
+        {
+            this->risingEdgeTime = edgeTime;
+            this->has_rising_edge = true;
+        }
+        else if (this->has_rising_edge && this->is_measuring)
+        { // the pulse width is the time of the sound there and back
+            std::chrono::microseconds width = std::chrono::duration_cast<std::chrono::microseconds>(edgeTime - this->risingEdgeTime);
+            // a pulse as long as the module's own timeout means nothing came back, it is not a range
+            int status = width.count() >= US_NO_ECHO_WIDTH_US ? TOF_NO_TARGET : TOF_RANGE_COMPLETE;
+            sample = {(int)(width.count() * 0.343 / 2), status, 0, 0, this->risingEdgeTime};
+            this->has_rising_edge = false;
+            this->is_measuring = false;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -19,18 +19,25 @@
 #include <stdbool.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include "tof.h"
 
-static int file_i2c = 0;
-static int last_slave_address = -1;
-static unsigned char stop_variable;
-static uint32_t measurement_timing_budget_us;
+static I2CDEV bus = {0, -1}; // the shared bus handle used by the original (non "Dev") functions
+static bool combined_supported = true; // the adapter can do I2C_RDWR (repeated start) transfers
+static bool combined_enabled = true;   // use them; can be turned off to compare with write()+read()
+static TOFCTX tof; // the state of the sensor used by the original functions
+static TOFPOLLCFG poll_config = {90, 300, 250, 4000}; // see tofSetPollConfig()
 
-static int initSensor(int);
-static int performSingleRefCalibration(uint8_t vhv_init_byte);
-static int setMeasurementTimingBudget(uint32_t budget_us);
+static int runSteps(I2CDEV *pDev, TOFCTX *pCtx, int (*pfnStep)(I2CDEV *, TOFCTX *, int, int), int iParam);
+static void checkCombinedTransfers(int file);
+static int performSingleRefCalibration(I2CDEV *pDev, uint8_t vhv_init_byte);
+static void startRefCalibration(I2CDEV *pDev, uint8_t vhv_init_byte);
+static int refCalibrationDone(I2CDEV *pDev);
+static int setMeasurementTimingBudget(I2CDEV *pDev, TOFCTX *pCtx, uint32_t budget_us);
 
 #define calcMacroPeriod(vcsel_period_pclks) ((((uint32_t)2304 * (vcsel_period_pclks) * 1655) + 500) / 1000)
 // Encode VCSEL pulse period register value from period in PCLKs
@@ -44,7 +51,7 @@ static int setMeasurementTimingBudget(uint32_t budget_us);
 #define SEQUENCE_ENABLE_MSRC        0x04
 
 typedef enum vcselperiodtype { VcselPeriodPreRange, VcselPeriodFinalRange } vcselPeriodType;
-static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks);
+static int setVcselPulsePeriod(I2CDEV *pDev, TOFCTX *pCtx, vcselPeriodType type, uint8_t period_pclks);
 
 typedef struct tagSequenceStepTimeouts
     {
@@ -86,6 +93,8 @@ typedef struct tagSequenceStepTimeouts
 #define GLOBAL_CONFIG_SPAD_ENABLES_REF_0        0xB0
 #define GPIO_HV_MUX_ACTIVE_HIGH                 0x84
 #define SYSTEM_INTERRUPT_CLEAR                  0x0B
+#define SYSTEM_INTERMEASUREMENT_PERIOD          0x04
+#define OSC_CALIBRATE_VAL                       0xF8
 //
 // Opens a file system handle to the I2C device
 // reads the calibration data and sets the device
@@ -95,44 +104,123 @@ int tofInit(int iChan, int iAddr, int bLongRange)
 {
   char filename[32];
 
-  if(file_i2c == 0)
+  if(bus.file == 0)
   {
     sprintf(filename,"/dev/i2c-%d", iChan);
-    if ((file_i2c = open(filename, O_RDWR)) < 0)
+    if ((bus.file = open(filename, O_RDWR)) < 0)
     {
       printf("ERROR: tofInit(): Failed to open the i2c bus; need to run as sudo?\n"); 
       return 0;
     }
+    checkCombinedTransfers(bus.file);
   }
 
-	if (ioctl(file_i2c, I2C_SLAVE, iAddr) < 0)
+	if (ioctl(bus.file, I2C_SLAVE, iAddr) < 0)
 	{
     printf("ERROR: tofInit():Failed to acquire bus access or talk to slave\n");
-		close(file_i2c);
-		file_i2c = -1;
+		close(bus.file);
+		bus.file = -1;
 		return 0;
 	}
+	bus.addr = iAddr;
 
-	return initSensor(bLongRange); // finally, initialize the magic numbers in the sensor
+	return runSteps(&bus, &tof, tofInitStepDev, bLongRange); // finally, initialize the magic numbers in the sensor
 
 } /* tofInit() */
 
+//
+// Same as tofInit(), but for a device opened with i2cOpenDev()
+//
+int tofInitDev(I2CDEV *pDev, TOFCTX *pCtx, int bLongRange)
+{
+	return runSteps(pDev, pCtx, tofInitStepDev, bLongRange);
+} /* tofInitDev() */
+
 
 //LZ modification starts here
 
+// asks the adapter whether it can do plain I2C messages (I2C_RDWR);
+// if not, the register reads fall back to a write() followed by a read()
+static void checkCombinedTransfers(int file)
+{
+unsigned long funcs = 0;
+
+  combined_supported = (ioctl(file, I2C_FUNCS, &funcs) == 0 && (funcs & I2C_FUNC_I2C));
+}
+
+bool tofSetCombinedTransfers(bool bEnable)
+{
+  combined_enabled = bEnable;
+
+  return (bEnable && !combined_supported);
+}
+
+bool tofGetCombinedTransfers(void)
+{
+  return (combined_enabled && combined_supported);
+}
+
+//
+// Read iCount bytes starting at register ucAddr of the device.
+// The register address write and the data read are sent as one I2C_RDWR
+// transfer with a repeated start, so it costs one syscall and no other
+// traffic can get between the two. Without I2C_RDWR support it falls back
+// to a separate write() and read().
+// Returns the number of bytes read or -1 on error
+//
+static int readRegs(I2CDEV *pDev, unsigned char ucAddr, unsigned char *pBuf, int iCount)
+{
+struct i2c_msg msgs[2];
+struct i2c_rdwr_ioctl_data xfer;
+int rc;
+
+  if (combined_enabled && combined_supported && pDev->addr >= 0)
+  {
+    msgs[0].addr = pDev->addr;
+    msgs[0].flags = 0;
+    msgs[0].len = 1;
+    msgs[0].buf = &ucAddr;
+    msgs[1].addr = pDev->addr;
+    msgs[1].flags = I2C_M_RD;
+    msgs[1].len = iCount;
+    msgs[1].buf = pBuf;
+    xfer.msgs = msgs;
+    xfer.nmsgs = 2;
+
+    rc = ioctl(pDev->file, I2C_RDWR, &xfer);
+    if (rc == 2)
+      return iCount;
+    if (errno != EOPNOTSUPP && errno != ENOTTY)
+      return -1; // the slave did not answer, the fallback would not help either
+
+    printf("WARNING: readRegs(): I2C_RDWR is not supported, falling back to write()+read()\n");
+    combined_supported = false;
+  }
+
+  rc = write(pDev->file, &ucAddr, 1);
+  if (rc != 1)
+    return -1;
+
+  return read(pDev->file, pBuf, iCount);
+} /* readRegs() */
+
 bool initI2C(int iChan)
 {
   bool ret = false;
   char filename[32];
 
-  if(file_i2c == 0)
+  if(bus.file == 0)
   {
     sprintf(filename,"/dev/i2c-%d", iChan);
-    if ((file_i2c = open(filename, O_RDWR)) < 0)
+    if ((bus.file = open(filename, O_RDWR)) < 0)
     {
       printf("ERROR: initI2C(): Failed to open the i2c bus; need to run as sudo?\n"); 
       ret = true;
     }
+    else
+    {
+      checkCombinedTransfers(bus.file);
+    }
   }
 
   return ret;
@@ -154,90 +242,157 @@ bool switchSensor(int iAddr)
 {
   bool ret = false;
 
-  if(last_slave_address != iAddr)
+  if(bus.addr != iAddr)
   {
-    if (ioctl(file_i2c, I2C_SLAVE, iAddr) < 0)
+    if (ioctl(bus.file, I2C_SLAVE, iAddr) < 0)
     {
       printf("ERROR: switchSensor():Failed to acquire bus access or talk to slave\n"); 
       ret = true;
     }
     else
     {
-      last_slave_address = iAddr;
+      bus.addr = iAddr;
     }
   }
 
   return ret;
 }
 
+// Every device handle has its own file handle which is bound to the
+// device's address once, here, so the device can be used without
+// switchSensor() and independently of the other devices on the bus
+bool i2cOpenDev(I2CDEV *pDev, int iChan, int iAddr)
+{
+  char filename[32];
+
+  sprintf(filename,"/dev/i2c-%d", iChan);
+  if ((pDev->file = open(filename, O_RDWR)) < 0)
+  {
+    printf("ERROR: i2cOpenDev(): Failed to open the i2c bus; need to run as sudo?\n");
+    pDev->addr = -1;
+    return true;
+  }
+  checkCombinedTransfers(pDev->file);
+
+  pDev->addr = -1;
+  if (i2cSetAddressDev(pDev, iAddr))
+  {
+    i2cCloseDev(pDev);
+    return true;
+  }
+
+  return false;
+} /* i2cOpenDev() */
+
+bool i2cSetAddressDev(I2CDEV *pDev, int iAddr)
+{
+  if (ioctl(pDev->file, I2C_SLAVE, iAddr) < 0)
+  {
+    printf("ERROR: i2cSetAddressDev():Failed to acquire bus access or talk to slave 0x%x\n", iAddr);
+    return true;
+  }
+  pDev->addr = iAddr;
+
+  return false;
+} /* i2cSetAddressDev() */
+
+void i2cCloseDev(I2CDEV *pDev)
+{
+  if (pDev->file > 0)
+    close(pDev->file);
+  pDev->file = -1;
+  pDev->addr = -1;
+} /* i2cCloseDev() */
+
+// Same as setSensorAddress(), the handle has to be moved to
+// the new address with i2cSetAddressDev() afterwards
+void tofSetAddressDev(I2CDEV *pDev, int new_addr)
+{
+  writeRegDev(pDev, I2C_SLAVE_DEVICE_ADDRESS, new_addr & 0x7F);
+} /* tofSetAddressDev() */
+
 // end LZ modification ends here
 
 //
 // Read a pair of registers as a 16-bit value
 //
-unsigned short readReg16(unsigned char ucAddr)
+unsigned short readReg16Dev(I2CDEV *pDev, unsigned char ucAddr)
 {
-unsigned char ucTemp[2];
-int rc;
+unsigned char ucTemp[2] = {0, 0};
 
-	rc = write(file_i2c, &ucAddr, 1);
-	if (rc == 1)
-	{
-		rc = read(file_i2c, ucTemp, 2);
-	}
+	readRegs(pDev, ucAddr, ucTemp, 2);
 	return (unsigned short)((ucTemp[0]<<8) + ucTemp[1]);
+} /* readReg16Dev() */
+
+unsigned short readReg16(unsigned char ucAddr)
+{
+	return readReg16Dev(&bus, ucAddr);
 } /* readReg16() */
 
 //
 // Read a single register value from I2C device
 //
-unsigned char readReg(unsigned char ucAddr)
+unsigned char readRegDev(I2CDEV *pDev, unsigned char ucAddr)
 {
 unsigned char ucTemp;
-int rc;
 
         ucTemp = ucAddr;
-        rc = write(file_i2c, &ucTemp, 1);
-	if (rc == 1)
-	{
-        	rc = read(file_i2c, &ucTemp, 1);
-		if (rc != 1) {};
-	}
+	readRegs(pDev, ucAddr, &ucTemp, 1);
 	return ucTemp;
+} /* readRegDev() */
+
+unsigned char readReg(unsigned char ucAddr)
+{
+	return readRegDev(&bus, ucAddr);
 } /* ReadReg() */
 
-void readMulti(unsigned char ucAddr, unsigned char *pBuf, int iCount)
+int readMultiDev(I2CDEV *pDev, unsigned char ucAddr, unsigned char *pBuf, int iCount)
 {
 int rc;
 
-	rc = write(file_i2c, &ucAddr, 1);
-	if (rc == 1)
-	{
-		rc = read(file_i2c, pBuf, iCount);
-		if (rc != iCount)
-    {
-      printf("readMulti fails reading %d bytes from address %p\n", iCount, pBuf);
-    };
-	}
+	rc = readRegs(pDev, ucAddr, pBuf, iCount);
+	if (rc != iCount)
+  {
+    printf("readMulti fails reading %d bytes from address %p\n", iCount, pBuf);
+    return -1;
+  };
+  return 0;
+} /* readMultiDev() */
+
+void readMulti(unsigned char ucAddr, unsigned char *pBuf, int iCount)
+{
+	readMultiDev(&bus, ucAddr, pBuf, iCount);
 } /* readMulti() */
 
-void writeMulti(unsigned char ucAddr, unsigned char *pBuf, int iCount)
+int writeMultiDev(I2CDEV *pDev, unsigned char ucAddr, unsigned char *pBuf, int iCount)
 {
-unsigned char ucTemp[16];
+unsigned char ucTemp[65]; // up to 64 bytes, e.g. all the channels of a PCA9685
 int rc;
 
+	if (iCount > (int)sizeof(ucTemp) - 1)
+	{
+		printf("writeMulti can't write %d bytes at once\n", iCount);
+		return -1;
+	}
 	ucTemp[0] = ucAddr;
 	memcpy(&ucTemp[1], pBuf, iCount);
-	rc = write(file_i2c, ucTemp, iCount+1);
+	rc = write(pDev->file, ucTemp, iCount+1);
 	if (rc != iCount+1)
   {
       printf("writeMulti fails writing %d bytes to address %p\n", iCount, pBuf);
+      return -1;
   };
+  return 0;
+} /* writeMultiDev() */
+
+void writeMulti(unsigned char ucAddr, unsigned char *pBuf, int iCount)
+{
+	writeMultiDev(&bus, ucAddr, pBuf, iCount);
 } /* writeMulti() */
 //
 // Write a 16-bit value to a register
 //
-void writeReg16(unsigned char ucAddr, unsigned short usValue)
+void writeReg16Dev(I2CDEV *pDev, unsigned char ucAddr, unsigned short usValue)
 {
 unsigned char ucTemp[4];
 int rc;
@@ -245,38 +400,88 @@ int rc;
 	ucTemp[0] = ucAddr;
 	ucTemp[1] = (unsigned char)(usValue >> 8); // MSB first
 	ucTemp[2] = (unsigned char)usValue;
-	rc = write(file_i2c, ucTemp, 3);
+	rc = write(pDev->file, ucTemp, 3);
 	if (rc != 3) {}; // suppress warning
+} /* writeReg16Dev() */
+
+void writeReg16(unsigned char ucAddr, unsigned short usValue)
+{
+	writeReg16Dev(&bus, ucAddr, usValue);
 } /* writeReg16() */
 //
 // Write a single register/value pair
 //
-void writeReg(unsigned char ucAddr, unsigned char ucValue)
+void writeRegDev(I2CDEV *pDev, unsigned char ucAddr, unsigned char ucValue)
 {
 unsigned char ucTemp[2];
 int rc;
 
 	ucTemp[0] = ucAddr;
 	ucTemp[1] = ucValue;
-	rc = write(file_i2c, ucTemp, 2);
+	rc = write(pDev->file, ucTemp, 2);
 	if (rc != 2) {}; // suppress warning
+} /* writeRegDev() */
+
+void writeReg(unsigned char ucAddr, unsigned char ucValue)
+{
+	writeRegDev(&bus, ucAddr, ucValue);
 } /* writeReg() */
 
 //
 // Write a list of register/value pairs to the I2C device
+// The pairs are sent as write messages of one I2C_RDWR transfer, as many
+// as the kernel takes in one call (I2C_RDWR_IOCTL_MAX_MSGS), instead of
+// a write() per pair. Without I2C_RDWR support it writes them one by one.
 //
-void writeRegList(unsigned char *ucList)
+void writeRegListDev(I2CDEV *pDev, unsigned char *ucList)
 {
 unsigned char ucCount = *ucList++; // count is the first element in the list
+struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+struct i2c_rdwr_ioctl_data xfer;
+int i, iChunk;
 int rc;
 
+	while (ucCount && combined_enabled && combined_supported && pDev->addr >= 0)
+	{
+		iChunk = (ucCount > I2C_RDWR_IOCTL_MAX_MSGS) ? I2C_RDWR_IOCTL_MAX_MSGS : ucCount;
+		for (i = 0; i < iChunk; i++)
+		{
+			msgs[i].addr = pDev->addr;
+			msgs[i].flags = 0;
+			msgs[i].len = 2;
+			msgs[i].buf = &ucList[i * 2];
+		}
+		xfer.msgs = msgs;
+		xfer.nmsgs = iChunk;
+
+		rc = ioctl(pDev->file, I2C_RDWR, &xfer);
+		if (rc != iChunk)
+		{
+			if (errno != EOPNOTSUPP && errno != ENOTTY)
+			{
+				printf("writeRegList fails writing %d registers\n", iChunk);
+				return;
+			}
+			printf("WARNING: writeRegList(): I2C_RDWR is not supported, falling back to write()\n");
+			combined_supported = false;
+			break;
+		}
+		ucList += iChunk * 2;
+		ucCount -= iChunk;
+	}
+
 	while (ucCount)
 	{
-		rc = write(file_i2c, ucList, 2);
+		rc = write(pDev->file, ucList, 2);
 		if (rc != 2) {};
 		ucList += 2;
 		ucCount--;
 	}
+} /* writeRegListDev() */
+
+void writeRegList(unsigned char *ucList)
+{
+	writeRegListDev(&bus, ucList);
 } /* writeRegList() */
 
 //
@@ -301,38 +506,34 @@ unsigned char ucDefTuning[] = {80, 0xff,0x01, 0x00,0x00, 0xff,0x00, 0x09,0x00,
 0x72,0xfe, 0x76,0x00, 0x77,0x00, 0xff,0x01, 0x0d,0x01, 0xff,0x00, 0x80,0x01,
 0x01,0xf8, 0xff,0x01, 0x8e,0x01, 0x00,0x01, 0xff,0x00, 0x80,0x00};
 
-static int getSpadInfo(unsigned char *pCount, unsigned char *pTypeIsAperture)
+// LZ
+// the SPAD info is read in two steps, so the bus is free while the sensor gets it
+static void startSpadInfo(I2CDEV *pDev)
+{
+  writeRegListDev(pDev, ucSPAD0);
+  writeRegDev(pDev, 0x83, readRegDev(pDev, 0x83) | 0x04);
+  writeRegListDev(pDev, ucSPAD1);
+} /* startSpadInfo() */
+
+// returns 1 if the info is there, 0 if it is not ready yet
+static int spadInfoDone(I2CDEV *pDev, unsigned char *pCount, unsigned char *pTypeIsAperture)
 {
-int iTimeout;
 unsigned char ucTemp;
-#define MAX_TIMEOUT 50
 
-  writeRegList(ucSPAD0);
-  writeReg(0x83, readReg(0x83) | 0x04);
-  writeRegList(ucSPAD1);
-  iTimeout = 0;
-  while(iTimeout < MAX_TIMEOUT)
-  {
-    if (readReg(0x83) != 0x00) break;
-    iTimeout++;
-    usleep(5000);
-  }
-  if (iTimeout == MAX_TIMEOUT)
-  {
-    fprintf(stderr, "Timeout while waiting for SPAD info\n");
+  if (readRegDev(pDev, 0x83) == 0x00)
     return 0;
-  }
-  writeReg(0x83,0x01);
-  ucTemp = readReg(0x92);
+  writeRegDev(pDev, 0x83,0x01);
+  ucTemp = readRegDev(pDev, 0x92);
   *pCount = (ucTemp & 0x7f);
   *pTypeIsAperture = (ucTemp & 0x80);
-  writeReg(0x81,0x00);
-  writeReg(0xff,0x06);
-  writeReg(0x83, readReg(0x83) & ~0x04);
-  writeRegList(ucSPAD2);
+  writeRegDev(pDev, 0x81,0x00);
+  writeRegDev(pDev, 0xff,0x06);
+  writeRegDev(pDev, 0x83, readRegDev(pDev, 0x83) & ~0x04);
+  writeRegListDev(pDev, ucSPAD2);
   
   return 1;
-} /* getSpadInfo() */
+} /* spadInfoDone() */
+// end LZ
 
 // Decode sequence step timeout in MCLKs from register value
 // based on VL53L0X_decode_timeout()
@@ -389,25 +590,25 @@ static uint16_t encodeTimeout(uint16_t timeout_mclks)
   else { return 0; }
 }
 
-static void getSequenceStepTimeouts(uint8_t enables, SequenceStepTimeouts * timeouts)
+static void getSequenceStepTimeouts(I2CDEV *pDev, uint8_t enables, SequenceStepTimeouts * timeouts)
 {
-  timeouts->pre_range_vcsel_period_pclks = ((readReg(PRE_RANGE_CONFIG_VCSEL_PERIOD) +1) << 1);
+  timeouts->pre_range_vcsel_period_pclks = ((readRegDev(pDev, PRE_RANGE_CONFIG_VCSEL_PERIOD) +1) << 1);
 
-  timeouts->msrc_dss_tcc_mclks = readReg(MSRC_CONFIG_TIMEOUT_MACROP) + 1;
+  timeouts->msrc_dss_tcc_mclks = readRegDev(pDev, MSRC_CONFIG_TIMEOUT_MACROP) + 1;
   timeouts->msrc_dss_tcc_us =
     timeoutMclksToMicroseconds(timeouts->msrc_dss_tcc_mclks,
                                timeouts->pre_range_vcsel_period_pclks);
 
   timeouts->pre_range_mclks =
-    decodeTimeout(readReg16(PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI));
+    decodeTimeout(readReg16Dev(pDev, PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI));
   timeouts->pre_range_us =
     timeoutMclksToMicroseconds(timeouts->pre_range_mclks,
                                timeouts->pre_range_vcsel_period_pclks);
 
-  timeouts->final_range_vcsel_period_pclks = ((readReg(FINAL_RANGE_CONFIG_VCSEL_PERIOD) +1) << 1);
+  timeouts->final_range_vcsel_period_pclks = ((readRegDev(pDev, FINAL_RANGE_CONFIG_VCSEL_PERIOD) +1) << 1);
 
   timeouts->final_range_mclks =
-    decodeTimeout(readReg16(FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI));
+    decodeTimeout(readReg16Dev(pDev, FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI));
 
   if (enables & SEQUENCE_ENABLE_PRE_RANGE)
   {
@@ -427,15 +628,15 @@ static void getSequenceStepTimeouts(uint8_t enables, SequenceStepTimeouts * time
 //  pre:  12 to 18 (initialized default: 14)
 //  final: 8 to 14 (initialized default: 10)
 // based on VL53L0X_set_vcsel_pulse_period()
-static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
+static int setVcselPulsePeriod(I2CDEV *pDev, TOFCTX *pCtx, vcselPeriodType type, uint8_t period_pclks)
 {
   uint8_t vcsel_period_reg = encodeVcselPeriod(period_pclks);
 
   uint8_t enables;
   SequenceStepTimeouts timeouts;
 
-  enables = readReg(SYSTEM_SEQUENCE_CONFIG);
-  getSequenceStepTimeouts(enables, &timeouts);
+  enables = readRegDev(pDev, SYSTEM_SEQUENCE_CONFIG);
+  getSequenceStepTimeouts(pDev, enables, &timeouts);
 
   // "Apply specific settings for the requested clock period"
   // "Re-calculate and apply timeouts, in macro periods"
@@ -456,29 +657,29 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
     switch (period_pclks)
     {
       case 12:
-        writeReg(PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x18);
+        writeRegDev(pDev, PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x18);
         break;
 
       case 14:
-        writeReg(PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x30);
+        writeRegDev(pDev, PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x30);
         break;
 
       case 16:
-        writeReg(PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x40);
+        writeRegDev(pDev, PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x40);
         break;
 
       case 18:
-        writeReg(PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x50);
+        writeRegDev(pDev, PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0x50);
         break;
 
       default:
         // invalid period
         return 0;
     }
-    writeReg(PRE_RANGE_CONFIG_VALID_PHASE_LOW, 0x08);
+    writeRegDev(pDev, PRE_RANGE_CONFIG_VALID_PHASE_LOW, 0x08);
 
     // apply new VCSEL period
-    writeReg(PRE_RANGE_CONFIG_VCSEL_PERIOD, vcsel_period_reg);
+    writeRegDev(pDev, PRE_RANGE_CONFIG_VCSEL_PERIOD, vcsel_period_reg);
 
     // update timeouts
 
@@ -488,7 +689,7 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
     uint16_t new_pre_range_timeout_mclks =
       timeoutMicrosecondsToMclks(timeouts.pre_range_us, period_pclks);
 
-    writeReg16(PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+    writeReg16Dev(pDev, PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI,
       encodeTimeout(new_pre_range_timeout_mclks));
 
     // set_sequence_step_timeout() end
@@ -499,7 +700,7 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
     uint16_t new_msrc_timeout_mclks =
       timeoutMicrosecondsToMclks(timeouts.msrc_dss_tcc_us, period_pclks);
 
-    writeReg(MSRC_CONFIG_TIMEOUT_MACROP,
+    writeRegDev(pDev, MSRC_CONFIG_TIMEOUT_MACROP,
       (new_msrc_timeout_mclks > 256) ? 255 : (new_msrc_timeout_mclks - 1));
 
     // set_sequence_step_timeout() end
@@ -509,43 +710,43 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
     switch (period_pclks)
     {
       case 8:
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x10);
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
-        writeReg(GLOBAL_CONFIG_VCSEL_WIDTH, 0x02);
-        writeReg(ALGO_PHASECAL_CONFIG_TIMEOUT, 0x0C);
-        writeReg(0xFF, 0x01);
-        writeReg(ALGO_PHASECAL_LIM, 0x30);
-        writeReg(0xFF, 0x00);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x10);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
+        writeRegDev(pDev, GLOBAL_CONFIG_VCSEL_WIDTH, 0x02);
+        writeRegDev(pDev, ALGO_PHASECAL_CONFIG_TIMEOUT, 0x0C);
+        writeRegDev(pDev, 0xFF, 0x01);
+        writeRegDev(pDev, ALGO_PHASECAL_LIM, 0x30);
+        writeRegDev(pDev, 0xFF, 0x00);
         break;
 
       case 10:
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x28);
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
-        writeReg(GLOBAL_CONFIG_VCSEL_WIDTH, 0x03);
-        writeReg(ALGO_PHASECAL_CONFIG_TIMEOUT, 0x09);
-        writeReg(0xFF, 0x01);
-        writeReg(ALGO_PHASECAL_LIM, 0x20);
-        writeReg(0xFF, 0x00);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x28);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
+        writeRegDev(pDev, GLOBAL_CONFIG_VCSEL_WIDTH, 0x03);
+        writeRegDev(pDev, ALGO_PHASECAL_CONFIG_TIMEOUT, 0x09);
+        writeRegDev(pDev, 0xFF, 0x01);
+        writeRegDev(pDev, ALGO_PHASECAL_LIM, 0x20);
+        writeRegDev(pDev, 0xFF, 0x00);
         break;
 
       case 12:
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x38);
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
-        writeReg(GLOBAL_CONFIG_VCSEL_WIDTH, 0x03);
-        writeReg(ALGO_PHASECAL_CONFIG_TIMEOUT, 0x08);
-        writeReg(0xFF, 0x01);
-        writeReg(ALGO_PHASECAL_LIM, 0x20);
-        writeReg(0xFF, 0x00);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x38);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
+        writeRegDev(pDev, GLOBAL_CONFIG_VCSEL_WIDTH, 0x03);
+        writeRegDev(pDev, ALGO_PHASECAL_CONFIG_TIMEOUT, 0x08);
+        writeRegDev(pDev, 0xFF, 0x01);
+        writeRegDev(pDev, ALGO_PHASECAL_LIM, 0x20);
+        writeRegDev(pDev, 0xFF, 0x00);
         break;
 
       case 14:
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x48);
-        writeReg(FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
-        writeReg(GLOBAL_CONFIG_VCSEL_WIDTH, 0x03);
-        writeReg(ALGO_PHASECAL_CONFIG_TIMEOUT, 0x07);
-        writeReg(0xFF, 0x01);
-        writeReg(ALGO_PHASECAL_LIM, 0x20);
-        writeReg(0xFF, 0x00);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 0x48);
+        writeRegDev(pDev, FINAL_RANGE_CONFIG_VALID_PHASE_LOW,  0x08);
+        writeRegDev(pDev, GLOBAL_CONFIG_VCSEL_WIDTH, 0x03);
+        writeRegDev(pDev, ALGO_PHASECAL_CONFIG_TIMEOUT, 0x07);
+        writeRegDev(pDev, 0xFF, 0x01);
+        writeRegDev(pDev, ALGO_PHASECAL_LIM, 0x20);
+        writeRegDev(pDev, 0xFF, 0x00);
         break;
 
       default:
@@ -554,7 +755,7 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
     }
 
     // apply new VCSEL period
-    writeReg(FINAL_RANGE_CONFIG_VCSEL_PERIOD, vcsel_period_reg);
+    writeRegDev(pDev, FINAL_RANGE_CONFIG_VCSEL_PERIOD, vcsel_period_reg);
 
     // update timeouts
 
@@ -574,7 +775,7 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
       new_final_range_timeout_mclks += timeouts.pre_range_mclks;
     }
 
-    writeReg16(FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+    writeReg16Dev(pDev, FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
     encodeTimeout(new_final_range_timeout_mclks));
 
     // set_sequence_step_timeout end
@@ -587,21 +788,28 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
 
   // "Finally, the timing budget must be re-applied"
 
-  setMeasurementTimingBudget(measurement_timing_budget_us);
+  setMeasurementTimingBudget(pDev, pCtx, pCtx->timing_budget_us);
 
-  // "Perform the phase calibration. This is needed after changing on vcsel period."
-  // VL53L0X_perform_phase_calibration() begin
-
-  uint8_t sequence_config = readReg(SYSTEM_SEQUENCE_CONFIG);
-  writeReg(SYSTEM_SEQUENCE_CONFIG, 0x02);
-  performSingleRefCalibration(0x0);
-  writeReg(SYSTEM_SEQUENCE_CONFIG, sequence_config);
-
-  // VL53L0X_perform_phase_calibration() end
+  // LZ: the phase calibration that is needed after changing the vcsel period is
+  // up to the caller, it can be done once after both periods (and in steps)
 
   return 1;
 }
 
+// "Perform the phase calibration. This is needed after changing on vcsel period."
+// based on VL53L0X_perform_phase_calibration()
+static int performPhaseCalibration(I2CDEV *pDev)
+{
+int rc;
+uint8_t sequence_config = readRegDev(pDev, SYSTEM_SEQUENCE_CONFIG);
+
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0x02);
+  rc = performSingleRefCalibration(pDev, 0x0);
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, sequence_config);
+
+  return rc;
+} /* performPhaseCalibration() */
+
 // Set the measurement timing budget in microseconds, which is the time allowed
 // for one measurement; the ST API and this library take care of splitting the
 // timing budget among the sub-steps in the ranging sequence. A longer timing
@@ -609,7 +817,7 @@ static int setVcselPulsePeriod(vcselPeriodType type, uint8_t period_pclks)
 // factor of N decreases the range measurement standard deviation by a factor of
 // sqrt(N). Defaults to about 33 milliseconds; the minimum is 20 ms.
 // based on VL53L0X_set_measurement_timing_budget_micro_seconds()
-static int setMeasurementTimingBudget(uint32_t budget_us)
+static int setMeasurementTimingBudget(I2CDEV *pDev, TOFCTX *pCtx, uint32_t budget_us)
 {
 uint32_t used_budget_us;
 uint32_t final_range_timeout_us;
@@ -632,8 +840,8 @@ uint16_t final_range_timeout_mclks;
 
   used_budget_us = StartOverhead + EndOverhead;
 
-  enables = readReg(SYSTEM_SEQUENCE_CONFIG);
-  getSequenceStepTimeouts(enables, &timeouts);
+  enables = readRegDev(pDev, SYSTEM_SEQUENCE_CONFIG);
+  getSequenceStepTimeouts(pDev, enables, &timeouts);
 
   if (enables & SEQUENCE_ENABLE_TCC)
   {
@@ -689,17 +897,17 @@ uint16_t final_range_timeout_mclks;
       final_range_timeout_mclks += timeouts.pre_range_mclks;
     }
 
-    writeReg16(FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+    writeReg16Dev(pDev, FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
       encodeTimeout(final_range_timeout_mclks));
 
     // set_sequence_step_timeout() end
 
-    measurement_timing_budget_us = budget_us; // store for internal reuse
+    pCtx->timing_budget_us = budget_us; // store for internal reuse
   }
   return 1;
 }
 
-static uint32_t getMeasurementTimingBudget(void)
+static uint32_t getMeasurementTimingBudget(I2CDEV *pDev, TOFCTX *pCtx)
 {
   uint8_t enables;
   SequenceStepTimeouts timeouts;
@@ -715,8 +923,8 @@ static uint32_t getMeasurementTimingBudget(void)
   // "Start and end overhead times always present"
   uint32_t budget_us = StartOverhead + EndOverhead;
 
-  enables = readReg(SYSTEM_SEQUENCE_CONFIG);
-  getSequenceStepTimeouts(enables, &timeouts);
+  enables = readRegDev(pDev, SYSTEM_SEQUENCE_CONFIG);
+  getSequenceStepTimeouts(pDev, enables, &timeouts);
 
   if (enables & SEQUENCE_ENABLE_TCC)
   {
@@ -742,56 +950,146 @@ static uint32_t getMeasurementTimingBudget(void)
     budget_us += (timeouts.final_range_us + FinalRangeOverhead);
   }
 
-  measurement_timing_budget_us = budget_us; // store for internal reuse
+  pCtx->timing_budget_us = budget_us; // store for internal reuse
   return budget_us;
 }
 
-static int performSingleRefCalibration(uint8_t vhv_init_byte)
+// LZ
+// a reference calibration in two steps, so the bus is free while it runs
+static void startRefCalibration(I2CDEV *pDev, uint8_t vhv_init_byte)
+{
+  writeRegDev(pDev, SYSRANGE_START, 0x01 | vhv_init_byte); // VL53L0X_REG_SYSRANGE_MODE_START_STOP
+} /* startRefCalibration() */
+
+// returns 1 if it is done (the sensor is stopped then), 0 if it is still running
+static int refCalibrationDone(I2CDEV *pDev)
+{
+  if ((readRegDev(pDev, RESULT_INTERRUPT_STATUS) & 0x07) == 0)
+    return 0;
+
+  writeRegDev(pDev, SYSTEM_INTERRUPT_CLEAR, 0x01);
+
+  writeRegDev(pDev, SYSRANGE_START, 0x00);
+
+  return 1;
+} /* refCalibrationDone() */
+// end LZ
+
+static int performSingleRefCalibration(I2CDEV *pDev, uint8_t vhv_init_byte)
 {
 int iTimeout;
-  writeReg(SYSRANGE_START, 0x01 | vhv_init_byte); // VL53L0X_REG_SYSRANGE_MODE_START_STOP
+  startRefCalibration(pDev, vhv_init_byte);
 
   iTimeout = 0;
-  while ((readReg(RESULT_INTERRUPT_STATUS) & 0x07) == 0)
+  while (!refCalibrationDone(pDev))
   {
     iTimeout++;
     usleep(5000);
     if (iTimeout > 100) { return 0; }
   }
 
-  writeReg(SYSTEM_INTERRUPT_CLEAR, 0x01);
-
-  writeReg(SYSRANGE_START, 0x00);
-
   return 1;
 } /* performSingleRefCalibration() */
 
 //
 // Initialize the vl53l0x
 //
-static int initSensor(int bLongRangeMode)
+// LZ
+// the VHV and phase calibration values, on register page 1
+// based on VL53L0X_ref_calibration_io()
+static void readRefCalibration(I2CDEV *pDev, uint8_t *pVhv, uint8_t *pPhase)
+{
+  writeRegDev(pDev, 0xFF, 0x01);
+  writeRegDev(pDev, 0x00, 0x00);
+  writeRegDev(pDev, 0xFF, 0x00);
+  *pVhv = readRegDev(pDev, 0xCB);
+  *pPhase = readRegDev(pDev, 0xEE);
+  writeRegDev(pDev, 0xFF, 0x01);
+  writeRegDev(pDev, 0x00, 0x01);
+  writeRegDev(pDev, 0xFF, 0x00);
+} /* readRefCalibration() */
+
+static void writeRefCalibration(I2CDEV *pDev, uint8_t vhv, uint8_t phase)
+{
+  writeRegDev(pDev, 0xFF, 0x01);
+  writeRegDev(pDev, 0x00, 0x00);
+  writeRegDev(pDev, 0xFF, 0x00);
+  writeRegDev(pDev, 0xCB, (readRegDev(pDev, 0xCB) & 0x80) | vhv);
+  writeRegDev(pDev, 0xEE, (readRegDev(pDev, 0xEE) & 0x80) | phase);
+  writeRegDev(pDev, 0xFF, 0x01);
+  writeRegDev(pDev, 0x00, 0x01);
+  writeRegDev(pDev, 0xFF, 0x00);
+} /* writeRefCalibration() */
+
+//
+// The cached calibration is good if it is of this kind of sensor, in this
+// mode, and the SPAD map is the one it was done with (just after a reset)
+// or the one it set (the sensor wasn't reset)
+//
+static bool checkCalibration(I2CDEV *pDev, const TOFCAL *pCal, const unsigned char *pSpadMap, int bLongRangeMode)
+{
+  if (readRegDev(pDev, REG_IDENTIFICATION_MODEL_ID) != 0xEE)
+    return false;
+  if (pCal->long_range != (bLongRangeMode ? 1 : 0))
+    return false;
+  return memcmp(pSpadMap, pCal->nvm_spad_map, 6) == 0 || memcmp(pSpadMap, pCal->ref_spad_map, 6) == 0;
+} /* checkCalibration() */
+// end LZ
+
+// LZ
+// the steps of tofInitStepDev(), the waits for the sensor are steps of their own
+enum
+{
+  INIT_DATA = TOF_STEP_FIRST, // the data init and the SPAD map (from the cache or its discovery starts)
+  INIT_SPAD_WAIT,   // the SPAD discovery
+  INIT_TUNING,      // the default tuning settings
+  INIT_TIMING,      // the interrupt and the timing budget, then the VHV calibration starts
+  INIT_VHV_WAIT,    // the VHV calibration, then the phase calibration starts
+  INIT_PHASE_WAIT   // the phase calibration
+};
+
+int tofInitStepDev(I2CDEV *pDev, TOFCTX *pCtx, int bLongRangeMode, int iStep)
 {
 unsigned char spad_count=0, spad_type_is_aperture=0, ref_spad_map[6];
 unsigned char ucFirstSPAD, ucSPADsEnabled;
 int i;
 
+  switch (iStep)
+  {
+  case INIT_DATA:
 // set 2.8V mode
-  writeReg(VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV,
-  readReg(VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV) | 0x01); // set bit 0
+  writeRegDev(pDev, VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV,
+  readRegDev(pDev, VHV_CONFIG_PAD_SCL_SDA__EXTSUP_HV) | 0x01); // set bit 0
 // Set I2C standard mode
-  writeRegList(ucI2CMode);
-  stop_variable = readReg(0x91);
-  writeRegList(ucI2CMode2);
+  writeRegListDev(pDev, ucI2CMode);
+  pCtx->stop_variable = readRegDev(pDev, 0x91);
+  writeRegListDev(pDev, ucI2CMode2);
 // disable SIGNAL_RATE_MSRC (bit 1) and SIGNAL_RATE_PRE_RANGE (bit 4) limit checks
-  writeReg(REG_MSRC_CONFIG_CONTROL, readReg(REG_MSRC_CONFIG_CONTROL) | 0x12);
+  writeRegDev(pDev, REG_MSRC_CONFIG_CONTROL, readRegDev(pDev, REG_MSRC_CONFIG_CONTROL) | 0x12);
   // Q9.7 fixed point format (9 integer bits, 7 fractional bits)
-  writeReg16(FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT, 32); // 0.25
-  writeReg(SYSTEM_SEQUENCE_CONFIG, 0xFF);
-  getSpadInfo(&spad_count, &spad_type_is_aperture);
+  writeReg16Dev(pDev, FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT, 32); // 0.25
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0xFF);
 
-  readMulti(GLOBAL_CONFIG_SPAD_ENABLES_REF_0, ref_spad_map, 6);
+  if (readMultiDev(pDev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, ref_spad_map, 6) != 0)
+    return TOF_STEP_FAILED;
 //printf("initial spad map: %02x,%02x,%02x,%02x,%02x,%02x\n", ref_spad_map[0], ref_spad_map[1], ref_spad_map[2], ref_spad_map[3], ref_spad_map[4], ref_spad_map[5]);
-  writeRegList(ucSPAD);
+  pCtx->cal_updated = !(pCtx->cal_valid && checkCalibration(pDev, &pCtx->cal, ref_spad_map, bLongRangeMode));
+  if (!pCtx->cal_updated)
+  { // LZ: no SPAD discovery, the map is known
+    writeRegListDev(pDev, ucSPAD);
+    writeMultiDev(pDev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, pCtx->cal.ref_spad_map, 6);
+    return INIT_TUNING;
+  }
+  pCtx->cal_valid = false; // until the calibration is done
+  memcpy(pCtx->cal.nvm_spad_map, ref_spad_map, 6);
+  startSpadInfo(pDev);
+  return INIT_SPAD_WAIT;
+
+  case INIT_SPAD_WAIT:
+  if (!spadInfoDone(pDev, &spad_count, &spad_type_is_aperture))
+    return INIT_SPAD_WAIT;
+  memcpy(ref_spad_map, pCtx->cal.nvm_spad_map, 6);
+  writeRegListDev(pDev, ucSPAD);
   ucFirstSPAD = (spad_type_is_aperture) ? 12: 0;
   ucSPADsEnabled = 0;
 // clear bits for unused SPADs
@@ -806,124 +1104,466 @@ int i;
       ucSPADsEnabled++;
     }
   } // for i
-  writeMulti(GLOBAL_CONFIG_SPAD_ENABLES_REF_0, ref_spad_map, 6);
+  pCtx->cal.spad_count = spad_count;
+  pCtx->cal.spad_type_is_aperture = spad_type_is_aperture ? 1 : 0;
+  memcpy(pCtx->cal.ref_spad_map, ref_spad_map, 6);
+  writeMultiDev(pDev, GLOBAL_CONFIG_SPAD_ENABLES_REF_0, ref_spad_map, 6);
 //printf("final spad map: %02x,%02x,%02x,%02x,%02x,%02x\n", ref_spad_map[0], 
 //ref_spad_map[1], ref_spad_map[2], ref_spad_map[3], ref_spad_map[4], ref_spad_map[5]);
+  return INIT_TUNING;
 
+  case INIT_TUNING:
 // load default tuning settings
-  writeRegList(ucDefTuning); // long list of magic numbers
+  writeRegListDev(pDev, ucDefTuning); // long list of magic numbers
 
 // change some settings for long range mode
   if (bLongRangeMode)
-  {
-	writeReg16(FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT, 13); // 0.1
-	setVcselPulsePeriod(VcselPeriodPreRange, 18);
-	setVcselPulsePeriod(VcselPeriodFinalRange, 14);
+  { // the reference calibration below (or the cached one) is done with these periods
+	writeReg16Dev(pDev, FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT, 13); // 0.1
+	setVcselPulsePeriod(pDev, pCtx, VcselPeriodPreRange, 18);
+	setVcselPulsePeriod(pDev, pCtx, VcselPeriodFinalRange, 14);
   }
+  pCtx->profile = bLongRangeMode ? TOF_PROFILE_LONG_RANGE : TOF_PROFILE_DEFAULT;
+  return INIT_TIMING;
 
+  case INIT_TIMING:
 // set interrupt configuration to "new sample ready"
-  writeReg(SYSTEM_INTERRUPT_CONFIG_GPIO, 0x04);
-  writeReg(GPIO_HV_MUX_ACTIVE_HIGH, readReg(GPIO_HV_MUX_ACTIVE_HIGH) & ~0x10); // active low
-  writeReg(SYSTEM_INTERRUPT_CLEAR, 0x01);
-  measurement_timing_budget_us = getMeasurementTimingBudget();
-  writeReg(SYSTEM_SEQUENCE_CONFIG, 0xe8);
-  setMeasurementTimingBudget(measurement_timing_budget_us);
-  writeReg(SYSTEM_SEQUENCE_CONFIG, 0x01);
-  if (!performSingleRefCalibration(0x40)) { 
-    printf("ERROR: initSensor(): performSingleRefCalibration(0x40) fails\n");
-    return 0;
+  writeRegDev(pDev, SYSTEM_INTERRUPT_CONFIG_GPIO, 0x04);
+  writeRegDev(pDev, GPIO_HV_MUX_ACTIVE_HIGH, readRegDev(pDev, GPIO_HV_MUX_ACTIVE_HIGH) & ~0x10); // active low
+  writeRegDev(pDev, SYSTEM_INTERRUPT_CLEAR, 0x01);
+  pCtx->timing_budget_us = getMeasurementTimingBudget(pDev, pCtx);
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0xe8);
+  setMeasurementTimingBudget(pDev, pCtx, pCtx->timing_budget_us);
+  if (!pCtx->cal_updated)
+  { // LZ: the results of the reference calibration are known too
+    writeRefCalibration(pDev, pCtx->cal.vhv_settings, pCtx->cal.phase_cal);
+    writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0xe8);
+    return TOF_STEP_DONE;
   }
-  writeReg(SYSTEM_SEQUENCE_CONFIG, 0x02);
-  if (!performSingleRefCalibration(0x00)) {
-    printf("ERROR: initSensor(): performSingleRefCalibration(0.00) fails\n");
-    return 0;
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0x01);
+  startRefCalibration(pDev, 0x40);
+  return INIT_VHV_WAIT;
+
+  case INIT_VHV_WAIT:
+  if (!refCalibrationDone(pDev))
+    return INIT_VHV_WAIT;
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0x02);
+  startRefCalibration(pDev, 0x00);
+  return INIT_PHASE_WAIT;
+
+  case INIT_PHASE_WAIT:
+  if (!refCalibrationDone(pDev))
+    return INIT_PHASE_WAIT;
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0xe8);
+
+  readRefCalibration(pDev, &pCtx->cal.vhv_settings, &pCtx->cal.phase_cal);
+  pCtx->cal.long_range = bLongRangeMode ? 1 : 0;
+  pCtx->cal_valid = true;
+  return TOF_STEP_DONE;
   }
-  writeReg(SYSTEM_SEQUENCE_CONFIG, 0xe8);
 
+  printf("ERROR: tofInitStepDev(): there is no step %d\n", iStep);
+  return TOF_STEP_FAILED;
+} /* tofInitStepDev() */
+
+//
+// Runs the steps one after the other, waiting in between when the sensor
+// needs time; for the callers that don't share the bus
+//
+static int runSteps(I2CDEV *pDev, TOFCTX *pCtx, int (*pfnStep)(I2CDEV *, TOFCTX *, int, int), int iParam)
+{
+int iStep = TOF_STEP_FIRST, iNext, iWaits = 0;
+
+  while (iStep != TOF_STEP_DONE)
+  {
+    iNext = (*pfnStep)(pDev, pCtx, iParam, iStep);
+    if (iNext == TOF_STEP_FAILED)
+      return 0;
+    if (iNext == iStep)
+    {
+      if (++iWaits > TOF_STEP_MAX_WAITS)
+      {
+        printf("ERROR: runSteps(): step %d timed out\n", iStep);
+        return 0;
+      }
+      usleep(TOF_STEP_WAIT_US);
+    }
+    else
+      iWaits = 0;
+    iStep = iNext;
+  }
   return 1;
-} /* initSensor() */
+} /* runSteps() */
+// end LZ
+
+// LZ
+// the single ranging of tofReadDistance() in steps, so the caller can
+// let other devices use the bus while the sensor is measuring:
+// tofStartRangingDev(), then tofRangeReadyDev() until it returns 1,
+// then tofReadRangeDev()
+static void writeStopVariable(I2CDEV *pDev, TOFCTX *pCtx)
+{
+  writeRegDev(pDev, 0x80, 0x01);
+  writeRegDev(pDev, 0xFF, 0x01);
+  writeRegDev(pDev, 0x00, 0x00);
+  writeRegDev(pDev, 0x91, pCtx->stop_variable);
+  writeRegDev(pDev, 0x00, 0x01);
+  writeRegDev(pDev, 0xFF, 0x00);
+  writeRegDev(pDev, 0x80, 0x00);
+} /* writeStopVariable() */
+
+int tofStartRangingDev(I2CDEV *pDev, TOFCTX *pCtx)
+{
+  writeStopVariable(pDev, pCtx);
+
+  writeRegDev(pDev, SYSRANGE_START, 0x01);
 
-uint16_t readRangeContinuousMillimeters(void)
+  return 1;
+} /* tofStartRangingDev() */
+
+//
+// Continuous ranging: the sensor measures on its own, back-to-back
+// (period_ms is 0) or every period_ms milliseconds, and a read only
+// needs to fetch the latest result with tofRangeReadyDev() and tofReadRangeDev()
+// based on VL53L0X::startContinuous() of the Pololu library
+//
+int tofStartContinuousDev(I2CDEV *pDev, TOFCTX *pCtx, uint32_t period_ms)
 {
-int iTimeout = 0;
-uint16_t range;
+uint16_t osc_calibrate_val;
+unsigned char ucTemp[4];
 
-  while ((readReg(RESULT_INTERRUPT_STATUS) & 0x07) == 0)
+  writeStopVariable(pDev, pCtx);
+
+  if (period_ms != 0)
   {
-    iTimeout++;
-    usleep(5000);
-    if (iTimeout > 50)
+    // continuous timed mode
+    osc_calibrate_val = readReg16Dev(pDev, OSC_CALIBRATE_VAL);
+    if (osc_calibrate_val != 0)
     {
-      return -1;
+      period_ms *= osc_calibrate_val;
     }
+    ucTemp[0] = (unsigned char)(period_ms >> 24); // MSB first
+    ucTemp[1] = (unsigned char)(period_ms >> 16);
+    ucTemp[2] = (unsigned char)(period_ms >> 8);
+    ucTemp[3] = (unsigned char)period_ms;
+    writeMultiDev(pDev, SYSTEM_INTERMEASUREMENT_PERIOD, ucTemp, 4);
+
+    writeRegDev(pDev, SYSRANGE_START, 0x04); // VL53L0X_REG_SYSRANGE_MODE_TIMED
+  }
+  else
+  {
+    writeRegDev(pDev, SYSRANGE_START, 0x02); // VL53L0X_REG_SYSRANGE_MODE_BACKTOBACK
   }
 
+  return 1;
+} /* tofStartContinuousDev() */
+
+int tofStopContinuousDev(I2CDEV *pDev)
+{
+  writeRegDev(pDev, SYSRANGE_START, 0x01); // VL53L0X_REG_SYSRANGE_MODE_SINGLESHOT
+
+  writeRegDev(pDev, 0xFF, 0x01);
+  writeRegDev(pDev, 0x00, 0x00);
+  writeRegDev(pDev, 0x91, 0x00);
+  writeRegDev(pDev, 0x00, 0x01);
+  writeRegDev(pDev, 0xFF, 0x00);
+
+  return 1;
+} /* tofStopContinuousDev() */
+
+//
+// Ranging profiles (like the examples of the Pololu library): long range
+// lowers the signal rate limit and lengthens the VCSEL pulses, the others
+// only change the timing budget
+//
+// the steps of tofSetProfileStepDev()
+enum
+{
+  PROFILE_VCSEL = TOF_STEP_FIRST, // the signal rate limit and the VCSEL periods, then the phase calibration starts
+  PROFILE_PHASE_WAIT, // the phase calibration
+  PROFILE_BUDGET      // the timing budget
+};
+
+int tofSetProfileStepDev(I2CDEV *pDev, TOFCTX *pCtx, TOFPROFILE profile, int iStep)
+{
+int bLongRange = (profile == TOF_PROFILE_LONG_RANGE);
+uint32_t budget_us;
+
+  switch (iStep)
+  {
+  case PROFILE_VCSEL:
+  if (bLongRange == (pCtx->profile == TOF_PROFILE_LONG_RANGE))
+    return PROFILE_BUDGET;
+  // Q9.7 fixed point format: 0.1 for long range, 0.25 otherwise
+  writeReg16Dev(pDev, FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT, bLongRange ? 13 : 32);
+  if (!setVcselPulsePeriod(pDev, pCtx, VcselPeriodPreRange, bLongRange ? 18 : 14) ||
+      !setVcselPulsePeriod(pDev, pCtx, VcselPeriodFinalRange, bLongRange ? 14 : 10))
+    return TOF_STEP_FAILED;
+  pCtx->sequence_config = readRegDev(pDev, SYSTEM_SEQUENCE_CONFIG);
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, 0x02);
+  startRefCalibration(pDev, 0x00);
+  return PROFILE_PHASE_WAIT;
+
+  case PROFILE_PHASE_WAIT:
+  if (!refCalibrationDone(pDev))
+    return PROFILE_PHASE_WAIT;
+  writeRegDev(pDev, SYSTEM_SEQUENCE_CONFIG, pCtx->sequence_config);
+  return PROFILE_BUDGET;
+
+  case PROFILE_BUDGET:
+  break;
+
+  default:
+  printf("ERROR: tofSetProfileStepDev(): there is no step %d\n", iStep);
+  return TOF_STEP_FAILED;
+  }
+
+  switch (profile)
+  {
+    case TOF_PROFILE_HIGH_SPEED:
+      budget_us = 20000;
+      break;
+    case TOF_PROFILE_HIGH_ACCURACY:
+      budget_us = 200000;
+      break;
+    default:
+      budget_us = 33000;
+      break;
+  }
+  if (!setMeasurementTimingBudget(pDev, pCtx, budget_us))
+    return TOF_STEP_FAILED;
+
+  pCtx->profile = profile;
+  return TOF_STEP_DONE;
+} /* tofSetProfileStepDev() */
+
+static int setProfileStep(I2CDEV *pDev, TOFCTX *pCtx, int iProfile, int iStep)
+{
+  return tofSetProfileStepDev(pDev, pCtx, (TOFPROFILE)iProfile, iStep);
+} /* setProfileStep() */
+
+int tofSetProfileDev(I2CDEV *pDev, TOFCTX *pCtx, TOFPROFILE profile)
+{
+  return runSteps(pDev, pCtx, setProfileStep, (int)profile);
+} /* tofSetProfileDev() */
+
+int tofSetTimingBudgetDev(I2CDEV *pDev, TOFCTX *pCtx, uint32_t budget_us)
+{
+  return setMeasurementTimingBudget(pDev, pCtx, budget_us);
+} /* tofSetTimingBudgetDev() */
+
+int tofSetVcselPeriodsDev(I2CDEV *pDev, TOFCTX *pCtx, int pre_pclks, int final_pclks)
+{
+  if (!setVcselPulsePeriod(pDev, pCtx, VcselPeriodPreRange, (uint8_t)pre_pclks))
+    return 0;
+  if (!setVcselPulsePeriod(pDev, pCtx, VcselPeriodFinalRange, (uint8_t)final_pclks))
+    return 0;
+  return performPhaseCalibration(pDev);
+} /* tofSetVcselPeriodsDev() */
+
+int tofRangeReadyDev(I2CDEV *pDev)
+{
+  return ((readRegDev(pDev, RESULT_INTERRUPT_STATUS) & 0x07) != 0);
+} /* tofRangeReadyDev() */
+
+int tofReadRangeDev(I2CDEV *pDev)
+{
+uint16_t range;
+
   // assumptions: Linearity Corrective Gain is 1000 (default);
   // fractional ranging is not enabled
-  range = readReg16(RESULT_RANGE_STATUS + 10);
+  range = readReg16Dev(pDev, RESULT_RANGE_STATUS + 10);
 
-  writeReg(SYSTEM_INTERRUPT_CLEAR, 0x01);
+  writeRegDev(pDev, SYSTEM_INTERRUPT_CLEAR, 0x01);
 
   return range;
+} /* tofReadRangeDev() */
+
+//
+// Reads the 12 bytes of the result at once: the range status, the effective
+// SPAD count, the signal and ambient rates and the range
+// based on VL53L0X_GetRangingMeasurementData()
+//
+int tofReadSampleDev(I2CDEV *pDev, TOFSAMPLE *pSample)
+{
+unsigned char ucTemp[12] = {0};
+
+  if (readMultiDev(pDev, RESULT_RANGE_STATUS, ucTemp, 12) != 0)
+  { // there is no result, it must not look like one at 0mm
+    memset(pSample, 0, sizeof(TOFSAMPLE));
+    pSample->range_mm = TOF_TIMEOUT;
+    writeRegDev(pDev, SYSTEM_INTERRUPT_CLEAR, 0x01);
+    return TOF_TIMEOUT;
+  }
+  writeRegDev(pDev, SYSTEM_INTERRUPT_CLEAR, 0x01);
+
+  pSample->range_status = (ucTemp[0] & 0x78) >> 3;
+  pSample->effective_spad_count = (ucTemp[2] << 8) | ucTemp[3];
+  pSample->signal_rate = (ucTemp[6] << 8) | ucTemp[7];
+  pSample->ambient_rate = (ucTemp[8] << 8) | ucTemp[9];
+  pSample->range_mm = (ucTemp[10] << 8) | ucTemp[11];
+
+  return pSample->range_mm;
+} /* tofReadSampleDev() */
+
+static uint64_t monotonicMicroseconds(void)
+{
+struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
+
+uint32_t tofPollRemaining(const TOFPOLL *pPoll)
+{
+uint64_t now_us = monotonicMicroseconds();
+
+  if (now_us >= pPoll->deadline_us)
+    return 0;
+  return (uint32_t)(pPoll->deadline_us - now_us);
+} /* tofPollRemaining() */
+
+void tofSetPollConfig(const TOFPOLLCFG *pConfig)
+{
+  poll_config = *pConfig;
+}
+
+void tofGetPollConfig(TOFPOLLCFG *pConfig)
+{
+  *pConfig = poll_config;
+}
+
+uint32_t tofGetTimingBudget(const TOFCTX *pCtx)
+{
+  if (pCtx == NULL)
+    pCtx = &tof;
+  return pCtx->timing_budget_us;
+}
+
 //
-// Read the current distance in mm
+// Waiting for a result against a deadline: the first wait is most of the
+// timing budget (the measurement can't finish earlier), then short steps,
+// starting from 1/16 of the budget and doubling, until the deadline
 //
-int tofReadDistance(void)
+void tofPollStart(TOFPOLL *pPoll, const TOFPOLLCFG *pConfig, uint32_t budget_us)
 {
-int iTimeout;
+uint32_t step_us;
 
-  writeReg(0x80, 0x01);
-  writeReg(0xFF, 0x01);
-  writeReg(0x00, 0x00);
-  writeReg(0x91, stop_variable);
-  writeReg(0x00, 0x01);
-  writeReg(0xFF, 0x00);
-  writeReg(0x80, 0x00);
+  if (pConfig == NULL)
+    pConfig = &poll_config;
 
-  writeReg(SYSRANGE_START, 0x01);
+  step_us = budget_us / 16;
+  if (step_us < pConfig->min_step_us) step_us = pConfig->min_step_us;
+  if (step_us > pConfig->max_step_us) step_us = pConfig->max_step_us;
 
-  // "Wait until start bit has been cleared"
-  iTimeout = 0;
-  while (readReg(SYSRANGE_START) & 0x01)
+  pPoll->start_us = monotonicMicroseconds();
+  pPoll->deadline_us = pPoll->start_us + (uint64_t)budget_us * pConfig->timeout_pct / 100;
+  pPoll->next_wait_us = (uint32_t)((uint64_t)budget_us * pConfig->first_wait_pct / 100);
+  pPoll->step_us = step_us;
+  pPoll->max_step_us = pConfig->max_step_us;
+} /* tofPollStart() */
+
+//
+// Sleeps until the next poll; returns false if the deadline has passed
+//
+bool tofPollWait(TOFPOLL *pPoll)
+{
+uint64_t now_us = monotonicMicroseconds();
+uint64_t wait_us;
+
+  if (now_us >= pPoll->deadline_us)
+    return false;
+
+  wait_us = pPoll->next_wait_us;
+  if (now_us + wait_us > pPoll->deadline_us)
+    wait_us = pPoll->deadline_us - now_us;
+  if (wait_us > 0)
+    usleep((useconds_t)wait_us);
+
+  pPoll->next_wait_us = pPoll->step_us;
+  pPoll->step_us *= 2;
+  if (pPoll->step_us > pPoll->max_step_us)
+    pPoll->step_us = pPoll->max_step_us;
+
+  return true;
+} /* tofPollWait() */
+
+//
+// Polls until the result is ready or the deadline passes; bPollFirst checks
+// once before any waiting (in continuous mode the result may be there already)
+//
+static int waitRangeReady(I2CDEV *pDev, TOFCTX *pCtx, bool bPollFirst)
+{
+TOFPOLL poll;
+
+  tofPollStart(&poll, NULL, pCtx->timing_budget_us);
+  if (bPollFirst && tofRangeReadyDev(pDev))
+    return 1;
+
+  while (tofPollWait(&poll))
   {
-    iTimeout++;
-    usleep(5000);
-    if (iTimeout > 50)
-    {
-      return -1;
-    }
+    if (tofRangeReadyDev(pDev))
+      return 1;
   }
 
-  return readRangeContinuousMillimeters();
+  return 0;
+} /* waitRangeReady() */
+// end LZ
+
+int readRangeContinuousMillimeters(I2CDEV *pDev, TOFCTX *pCtx)
+{
+  if (!waitRangeReady(pDev, pCtx, true))
+    return TOF_TIMEOUT;
+
+  return tofReadRangeDev(pDev);
+}
+//
+// Read the current distance in mm
+//
+int tofReadDistanceDev(I2CDEV *pDev, TOFCTX *pCtx)
+{
+  tofStartRangingDev(pDev, pCtx);
+
+  // the interrupt status is set when the ranging is finished,
+  // so there is no need to wait for the start bit to be cleared first
+  if (!waitRangeReady(pDev, pCtx, false))
+    return TOF_TIMEOUT;
 
+  return tofReadRangeDev(pDev);
+
+} /* tofReadDistanceDev() */
+
+int tofReadDistance(void)
+{
+  return tofReadDistanceDev(&bus, &tof);
 } /* tofReadDistance() */
 
-int tofGetModel(int *model, int *revision)
+int tofGetModelDev(I2CDEV *pDev, int *model, int *revision)
 {
 unsigned char ucTemp[2];
 int i;
 
-	if (file_i2c == -1)
+	if (pDev->file == -1)
 		return 0;
 
 	if (model)
 	{
-		ucTemp[0] = REG_IDENTIFICATION_MODEL_ID;
-        	i = write(file_i2c, ucTemp, 1); // write address of register to read
-        	i = read(file_i2c, ucTemp, 1);
+		i = readRegs(pDev, REG_IDENTIFICATION_MODEL_ID, ucTemp, 1);
 		if (i == 1)
 			*model = ucTemp[0];
 	}
 	if (revision)
 	{
-		ucTemp[0] = REG_IDENTIFICATION_REVISION_ID;
-		i = write(file_i2c, ucTemp, 1);
-		i = read(file_i2c, ucTemp, 1);
+		i = readRegs(pDev, REG_IDENTIFICATION_REVISION_ID, ucTemp, 1);
 		if (i == 1)
 			*revision = ucTemp[0];
 	}
 	return 1;
 
+} /* tofGetModelDev() */
+
+int tofGetModel(int *model, int *revision)
+{
+	return tofGetModelDev(&bus, model, revision);
 } /* tofGetModel() */
 
@@ -18,6 +18,53 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <stdbool.h>
+#include <stdint.h>
+
+// LZ
+// handle of one device on the i2c bus: a file handle of its own,
+// bound to the device's slave address, and the address itself
+typedef struct tagI2CDEV
+{
+  int file;
+  int addr;
+} I2CDEV;
+
+// ranging profiles, see tofSetProfileDev()
+typedef enum tagTOFPROFILE
+{
+  TOF_PROFILE_DEFAULT = 0, // ~33ms budget, up to 1.2m
+  TOF_PROFILE_HIGH_SPEED,  // 20ms budget, less accurate
+  TOF_PROFILE_HIGH_ACCURACY, // 200ms budget
+  TOF_PROFILE_LONG_RANGE   // ~33ms budget, lower signal limit and longer VCSEL pulses, up to 2m
+} TOFPROFILE;
+
+// the results of the SPAD discovery and the reference calibration,
+// so a restart can apply them instead of doing it all again
+typedef struct tagTOFCAL
+{
+  uint8_t spad_count;
+  uint8_t spad_type_is_aperture;
+  uint8_t nvm_spad_map[6]; // the map after reset, identifies the sensor
+  uint8_t ref_spad_map[6]; // the map in use
+  uint8_t vhv_settings;
+  uint8_t phase_cal;
+  uint8_t long_range; // the mode it was done in
+} TOFCAL;
+
+// driver state of one sensor, filled by tofInitDev(), so the sensors
+// on the bus don't overwrite each other's values
+typedef struct tagTOFCTX
+{
+  unsigned char stop_variable;
+  uint32_t timing_budget_us;
+  TOFPROFILE profile;
+  TOFCAL cal; // if cal_valid is set before tofInitDev(), it is used when it matches the sensor
+  bool cal_valid;
+  bool cal_updated; // tofInitDev() did a full calibration and refreshed cal
+  uint8_t sequence_config; // kept while a calibration runs in steps
+} TOFCTX;
+// end LZ
+
 //
 // Read the model and revision of the
 // tof sensor
@@ -26,8 +73,13 @@ int tofGetModel(int* model, int* revision);
 
 //
 // Read the current distance in mm
+// (or TOF_TIMEOUT if the result was not ready in time)
 //
 int tofReadDistance(void);
+#define TOF_TIMEOUT -2
+#define TOF_NOT_READY -3 // no new result (yet)
+#define TOF_RANGE_COMPLETE 11 // the range status of a valid result
+#define TOF_NO_TARGET 4 // the range status when nothing sent the light back
 
 //
 // Opens a file system handle to the I2C device
@@ -40,6 +92,12 @@ int tofInit(int iChan, int iAddr, int bLongRange);
 bool initI2C(int iChan); // just opens the i2c file if it is not already open
 void setSensorAddress(int iChan, int new_addr); // sets the sensor address for the VL53L0X sensor
 bool switchSensor(int iAddr); // switches the i2c bus to the specified VL53L0X sensor
+// register reads are sent as one combined write-then-read (I2C_RDWR) transfer
+// and register lists as one multi-message transfer;
+// this turns that off/on (e.g. to benchmark the write()+read() fallback)
+// returns true if it is requested but the adapter doesn't support it
+bool tofSetCombinedTransfers(bool bEnable);
+bool tofGetCombinedTransfers(void); // true if the combined transfers are in use
 
 // functions implemented in the tof library, but exposed for reuse
 // therefore the static keyword is removed from their declarations
@@ -50,6 +108,82 @@ void writeReg16(unsigned char ucAddr, unsigned short usValue);
 void writeReg(unsigned char ucAddr, unsigned char ucValue);
 void writeMulti(unsigned char ucAddr, unsigned char* pBuf, int iCount);
 void writeRegList(unsigned char* ucList);
+
+// the same functions for a device handle instead of the shared bus,
+// these don't need switchSensor() and don't touch the other devices
+bool i2cOpenDev(I2CDEV *pDev, int iChan, int iAddr); // opens the bus for this device only
+bool i2cSetAddressDev(I2CDEV *pDev, int iAddr); // re-binds the handle to another address
+void i2cCloseDev(I2CDEV *pDev);
+int tofInitDev(I2CDEV *pDev, TOFCTX *pCtx, int bLongRange);
+// tofInitDev() in steps, none of them holds the bus long: start with TOF_STEP_FIRST and call it
+// again with the step it returns until that is TOF_STEP_DONE; a step that waits for the sensor
+// returns itself, it is called again after TOF_STEP_WAIT_US (at most TOF_STEP_MAX_WAITS times)
+int tofInitStepDev(I2CDEV *pDev, TOFCTX *pCtx, int bLongRange, int iStep);
+#define TOF_STEP_FIRST 1
+#define TOF_STEP_DONE 0
+#define TOF_STEP_FAILED -1
+#define TOF_STEP_WAIT_US 5000
+#define TOF_STEP_MAX_WAITS 100
+int tofReadDistanceDev(I2CDEV *pDev, TOFCTX *pCtx);
+int tofGetModelDev(I2CDEV *pDev, int *model, int *revision);
+// tofReadDistanceDev() in steps, the bus is free while the sensor measures:
+int tofStartRangingDev(I2CDEV *pDev, TOFCTX *pCtx); // starts a single ranging
+int tofRangeReadyDev(I2CDEV *pDev); // returns 1 if the result is ready
+int tofReadRangeDev(I2CDEV *pDev); // returns the result in mm
+// the whole result in one burst, instead of tofReadRangeDev()
+typedef struct tagTOFSAMPLE
+{
+  int range_mm;
+  uint8_t range_status; // TOF_RANGE_COMPLETE if the range is valid
+  uint16_t signal_rate; // MCPS, 9.7 fixed point
+  uint16_t ambient_rate; // MCPS, 9.7 fixed point
+  uint16_t effective_spad_count; // 8.8 fixed point
+} TOFSAMPLE;
+int tofReadSampleDev(I2CDEV *pDev, TOFSAMPLE *pSample); // returns the result in mm, TOF_TIMEOUT if it can't be read
+// continuous ranging: back-to-back (period 0) or timed, the results are read as above
+int tofStartContinuousDev(I2CDEV *pDev, TOFCTX *pCtx, uint32_t period_ms);
+int tofStopContinuousDev(I2CDEV *pDev);
+// these return 1 on success; call them when the sensor is not ranging
+int tofSetProfileDev(I2CDEV *pDev, TOFCTX *pCtx, TOFPROFILE profile);
+int tofSetProfileStepDev(I2CDEV *pDev, TOFCTX *pCtx, TOFPROFILE profile, int iStep); // in steps, as tofInitStepDev()
+int tofSetTimingBudgetDev(I2CDEV *pDev, TOFCTX *pCtx, uint32_t budget_us); // 20000us at least
+int tofSetVcselPeriodsDev(I2CDEV *pDev, TOFCTX *pCtx, int pre_pclks, int final_pclks); // pre: 12-18, final: 8-14 (even)
+void tofSetAddressDev(I2CDEV *pDev, int new_addr); // sets the sensor's new address (then use i2cSetAddressDev())
+unsigned char readRegDev(I2CDEV *pDev, unsigned char ucAddr);
+unsigned short readReg16Dev(I2CDEV *pDev, unsigned char ucAddr);
+int readMultiDev(I2CDEV *pDev, unsigned char ucAddr, unsigned char* pBuf, int iCount); // returns 0 on success, -1 on failure
+void writeReg16Dev(I2CDEV *pDev, unsigned char ucAddr, unsigned short usValue);
+void writeRegDev(I2CDEV *pDev, unsigned char ucAddr, unsigned char ucValue);
+int writeMultiDev(I2CDEV *pDev, unsigned char ucAddr, unsigned char* pBuf, int iCount); // returns 0 on success, -1 on failure
+void writeRegListDev(I2CDEV *pDev, unsigned char* ucList);
+
+// waiting for a ranging result against a deadline, all relative to the timing budget:
+// the first poll is after first_wait_pct % of it, then the wait between the polls
+// starts at 1/16 of it (but min_step_us at least) and doubles up to max_step_us,
+// and the waiting is given up after timeout_pct % of the budget
+typedef struct tagTOFPOLLCFG
+{
+  int first_wait_pct;
+  int timeout_pct;
+  uint32_t min_step_us;
+  uint32_t max_step_us;
+} TOFPOLLCFG;
+
+typedef struct tagTOFPOLL
+{
+  uint64_t start_us;
+  uint64_t deadline_us;
+  uint32_t next_wait_us;
+  uint32_t step_us;
+  uint32_t max_step_us;
+} TOFPOLL;
+
+void tofSetPollConfig(const TOFPOLLCFG *pConfig); // used by tofReadDistance()
+void tofGetPollConfig(TOFPOLLCFG *pConfig);
+uint32_t tofGetTimingBudget(const TOFCTX *pCtx); // in microseconds, NULL: the sensor of tofInit()
+void tofPollStart(TOFPOLL *pPoll, const TOFPOLLCFG *pConfig, uint32_t budget_us); // NULL: the default config
+bool tofPollWait(TOFPOLL *pPoll); // sleeps until the next poll, returns false after the deadline
+uint32_t tofPollRemaining(const TOFPOLL *pPoll); // microseconds left until the deadline, 0 after it
 // end LZ
 
 #endif // _TOFLIB_H